@@ -45,15 +45,67 @@ nan
 #include <algorithm>
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <iterator>
 #include <list>
+#include <map>
 #include <set>
 #include <sstream>
 #include <stack>
 #include <string>
 #include <vector>
 
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if __cplusplus >= 201103L
+#define LOG_YAML_THREADS 1
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#endif
+
+// Calls below this Severity compile to nothing; see LOG_YAML_INFO and friends
+#ifndef LOG_YAML_MIN_SEVERITY
+#define LOG_YAML_MIN_SEVERITY 0
+#endif
+
+#if defined(__linux__) && defined(__has_include) && !defined(LOG_YAML_NO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define LOG_YAML_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+#if __cplusplus >= 201703L && defined(__has_include) && !defined(LOG_YAML_NO_TO_CHARS)
+#if __has_include(<charconv>)
+#include <charconv>
+#ifdef __cpp_lib_to_chars
+#define LOG_YAML_TO_CHARS 1
+#endif
+#endif
+#endif
+
 namespace Log {
 
 // Adapted from C++ Reference to make gcc3 happy
@@ -94,144 +146,2138 @@ typedef integral_constant<bool, false> false_type;
 
   using namespace std;
 
-  class Log
+  // Integer formatting straight into a caller's buffer: no stream, no
+  // locale, no allocation. Two digits per step from a pair table.
+  // out needs room for INT_BUFSIZE chars; returns one past the last.
+  enum { INT_BUFSIZE = 24 };
+
+  inline char* format_unsigned(char* out, unsigned long v)
   {
-  private:
-    bool use_stderr;
-    vector<string> lines;
-    string stderr_prefix;
-    stack<set<string> > used_keys;
-    stack<unsigned> next_anon_key_to_try;
+    static const char pairs[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+      "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+      "8081828384858687888990919293949596979899";
+    char tmp[INT_BUFSIZE];
+    char* p = tmp + sizeof(tmp);
+    while(v >= 100) {
+      const char* d = pairs + (v % 100) * 2;
+      v /= 100;
+      *--p = d[1];
+      *--p = d[0];
+    }
+    if(v >= 10) {
+      const char* d = pairs + v * 2;
+      *--p = d[1];
+      *--p = d[0];
+    }
+    else
+      *--p = char('0' + v);
+    size_t n = tmp + sizeof(tmp) - p;
+    memcpy(out, p, n);
+    return out + n;
+  }
+
+  template<typename T>
+  inline char* format_integer(char* out, T v)
+  {
+    if(v < T(0)) {
+      *out++ = '-';
+      return format_unsigned(out, 0UL - static_cast<unsigned long>(v));
+    }
+    return format_unsigned(out, static_cast<unsigned long>(v));
+  }
+
+  // How float and double are written
+  enum FloatFormat {
+    FLOAT_SHORTEST,  // fewest digits that read back as exactly the same value
+    FLOAT_LEGACY     // ostream's default, 6 significant digits
+  };
+
+  enum { FLOAT_BUFSIZE = 32 };
+
+  inline bool reads_back(const char* s, double v, bool single)
+  {
+    return single ? strtof(s, 0) == float(v) : strtod(s, 0) == v;
+  }
+
+  // Rewrites s, a positive number as "%.*e" writes it, as its
+  // neighbour with the same count of significant digits, one unit in the
+  // last place up or down
+  inline void step_last_digit(char* s, bool up)
+  {
+    char* e = strchr(s, 'e');
+    int exp10 = atoi(e + 1);
+    char* d = e - 1;
+    for(; d >= s; d--) {
+      if(*d == '.')
+        continue;
+      if(*d != (up ? '9' : '0'))
+        break;
+      *d = up ? '0' : '9';
+    }
+    if(d >= s)
+      *d += up ? 1 : -1;
+    // 9.99 up is 1.00 and 1.00 down is 9.99, a decade over
+    if(d < s || s[0] == '0') {
+      s[0] = up ? '1' : '9';
+      exp10 += up ? 1 : -1;
+    }
+    snprintf(e, FLOAT_BUFSIZE - (e - s), "e%d", exp10);
+  }
+
+  // Writes |v|, finite and nonzero, to buf as "%e" would with the fewest
+  // digits that read back exactly, using printf and strtod alone.
+  // Any decimal of up to FLT_DIG/DBL_DIG digits survives the trip through
+  // a normal float/double, so start there; subnormals hold fewer digits.
+  // At each precision the correctly rounded candidate goes first, then its
+  // neighbour on the other side of v: next to a power of two the values
+  // that read back as v reach twice as far up as down, and the rounded one
+  // can fall outside while its neighbour is inside.
+  inline void shortest_printf(char* buf, double v, bool single)
+  {
+    double a = fabs(v);
+    int max = single ? 9 : 17;
+    int p = single ? FLT_DIG : DBL_DIG;
+    if(a < (single ? FLT_MIN : DBL_MIN))
+      p = 1;
+    for(;; p++) {
+      snprintf(buf, FLOAT_BUFSIZE, "%.*e", p - 1, a);
+      if(p == max || reads_back(buf, a, single))
+        return;
+      char other[FLOAT_BUFSIZE];
+      memcpy(other, buf, FLOAT_BUFSIZE);
+      step_last_digit(other, single ? strtof(buf, 0) < float(a) : strtod(buf, 0) < a);
+      if(reads_back(other, a, single)) {
+        memcpy(buf, other, FLOAT_BUFSIZE);
+        return;
+      }
+    }
+  }
+
+  // Significant digits (no dot, no sign, no trailing zeros) and decimal
+  // exponent of the first digit of a number in "%e" form
+  inline int split_scientific(char* digits, int& exp10, const char* buf)
+  {
+    int n = 0;
+    const char* c = buf;
+    for(; *c && *c != 'e'; c++)
+      if(*c >= '0' && *c <= '9')
+        digits[n++] = *c;
+    while(n > 1 && digits[n - 1] == '0')
+      n--;
+    exp10 = *c ? atoi(c + 1) : 0;
+    return n;
+  }
+
+  // Shortest significant digits and decimal exponent of the first digit
+  // for a finite nonzero v. Uses the C++17 Ryu-based to_chars when the
+  // library has it (and LOG_YAML_NO_TO_CHARS isn't defined), otherwise
+  // shortest_printf(), which gives the same digits.
+  inline int shortest_digits(char* digits, int& exp10, double v, bool single)
+  {
+    char buf[FLOAT_BUFSIZE];
+#ifdef LOG_YAML_TO_CHARS
+    char* end = single
+      ? std::to_chars(buf, buf + sizeof(buf), float(v), std::chars_format::scientific).ptr
+      : std::to_chars(buf, buf + sizeof(buf), v, std::chars_format::scientific).ptr;
+    *end = 0;
+#else
+    shortest_printf(buf, v, single);
+#endif
+    return split_scientific(digits, exp10, buf);
+  }
+
+  // Lays digits out the way printf's %g does with precision
+  // max(FLT_DIG or DBL_DIG, digit count)
+  inline char* format_shortest(char* out, double v, bool single)
+  {
+    if(v == 0 || v != v || v - v != 0)
+      return out + snprintf(out, FLOAT_BUFSIZE, "%g", v);
+    char digits[FLOAT_BUFSIZE];
+    int exp10;
+    int n = shortest_digits(digits, exp10, v, single);
+    int precision = std::max(n, single ? int(FLT_DIG) : int(DBL_DIG));
+    if(v < 0)
+      *out++ = '-';
+    if(exp10 < -4 || exp10 >= precision) {
+      *out++ = digits[0];
+      if(n > 1) {
+        *out++ = '.';
+        memcpy(out, digits + 1, n - 1);
+        out += n - 1;
+      }
+      *out++ = 'e';
+      *out++ = exp10 < 0 ? '-' : '+';
+      int e = exp10 < 0 ? -exp10 : exp10;
+      if(e < 10)
+        *out++ = '0';
+      return format_unsigned(out, e);
+    }
+    if(exp10 < 0) {
+      *out++ = '0';
+      *out++ = '.';
+      for(int i = -1; i > exp10; i--)
+        *out++ = '0';
+      memcpy(out, digits, n);
+      return out + n;
+    }
+    for(int i = 0; i <= exp10 || i < n; i++) {
+      if(i == exp10 + 1)
+        *out++ = '.';
+      *out++ = i < n ? digits[i] : '0';
+    }
+    return out;
+  }
+
+  // out needs room for FLOAT_BUFSIZE chars; returns one past the last
+  inline char* format_double(char* out, double v, FloatFormat f = FLOAT_SHORTEST)
+  {
+    if(f == FLOAT_LEGACY)
+      return out + snprintf(out, FLOAT_BUFSIZE, "%g", v);
+    return format_shortest(out, v, false);
+  }
+
+  inline char* format_float(char* out, float v, FloatFormat f = FLOAT_SHORTEST)
+  {
+    if(f == FLOAT_LEGACY)
+      return out + snprintf(out, FLOAT_BUFSIZE, "%g", double(v));
+    return format_shortest(out, v, true);
+  }
+
+  // escaping borrowed from https://github.com/kazuho/picojson/blob/master/picojson.h
+  // See LICENSE.picojson
+  inline void escape_char(string& out, char c)
+  {
+    switch (c) {
+#define MAP(val, sym)                           \
+      case val:                                 \
+        out += sym;                             \
+        break
+      MAP('"', "\\\"");
+      MAP('\\', "\\\\");
+      MAP('/', "\\/");
+      MAP('\b', "\\b");
+      MAP('\f', "\\f");
+      MAP('\n', "\\n");
+      MAP('\r', "\\r");
+      MAP('\t', "\\t");
+#undef MAP
+    default:
+      if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+        char buf[7];
+        snprintf(buf, sizeof(buf), "\\u%04x", c & 0xff);
+        out.append(buf, 6);
+      } else {
+        out += c;
+      }
+      break;
+    }
+  }
+
+  inline bool needs_escape(char c)
+  {
+    return static_cast<unsigned char>(c) < 0x20 || c == 0x7f
+      || c == '"' || c == '\\' || c == '/';
+  }
 
-    inline string indent()
+  // Length of the leading run of s that can be copied as is. Checks 32 or
+  // 16 bytes per step with AVX2/SSE2, then finishes byte by byte.
+  inline size_t clean_prefix(const char* s, size_t n)
+  {
+    size_t i = 0;
+#ifdef __AVX2__
     {
-      ostringstream o;
-      for(unsigned i=0; i<level; i++)
-        o << "  ";
-      return o.str();
+      const __m256i ctl = _mm256_set1_epi8(0x1f);
+      const __m256i del = _mm256_set1_epi8(0x7f);
+      const __m256i quote = _mm256_set1_epi8('"');
+      const __m256i backslash = _mm256_set1_epi8('\\');
+      const __m256i slash = _mm256_set1_epi8('/');
+      for(; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        // unsigned x <= 0x1f
+        __m256i m = _mm256_cmpeq_epi8(_mm256_max_epu8(x, ctl), ctl);
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, del));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, quote));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, backslash));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, slash));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if(mask)
+          return i + __builtin_ctz(mask);
+      }
     }
+#endif
+#ifdef __SSE2__
+    {
+      const __m128i ctl = _mm_set1_epi8(0x1f);
+      const __m128i del = _mm_set1_epi8(0x7f);
+      const __m128i quote = _mm_set1_epi8('"');
+      const __m128i backslash = _mm_set1_epi8('\\');
+      const __m128i slash = _mm_set1_epi8('/');
+      for(; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(x, ctl), ctl);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, del));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, quote));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, backslash));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, slash));
+        unsigned mask = _mm_movemask_epi8(m);
+        if(mask)
+          return i + __builtin_ctz(mask);
+      }
+    }
+#endif
+    for(; i < n; i++)
+      if(needs_escape(s[i]))
+        break;
+    return i;
+  }
 
-    inline void debug_line(const string &line) {
-      if(use_stderr)
-        cerr << line;
+  // Appends s escaped for a double-quoted YAML scalar
+  inline void escape_append(string& out, const char* s, size_t n)
+  {
+    while(n) {
+      size_t k = clean_prefix(s, n);
+      out.append(s, k);
+      if(k == n)
+        break;
+      escape_char(out, s[k]);
+      s += k + 1;
+      n -= k + 1;
     }
+  }
 
-    unsigned level;
+  // Where emitted lines go. Log only ever hands write() complete lines, so
+  // whatever a sink has received so far is valid YAML up to its last line.
+  class Sink
+  {
+  public:
+    virtual ~Sink() {}
+    virtual void write(const char* data, size_t n) = 0;
+    virtual void flush() {}
+    // Called before a line keyed directly under the top key; everything
+    // written so far is a complete top-level entry.
+    virtual void top_level() {}
+    // true if write() passes any bytes through untouched, not just lines,
+    // so a Recorder can use the sink. Sinks that look at the lines they are
+    // given, or add lines of their own, must leave this false.
+    virtual bool binary_safe() const { return false; }
+  };
 
-    inline string quoted(const string& str)
+  // Sink onto any ostream: a file, a stringstream, cout ...
+  class StreamSink : public Sink
+  {
+    ostream& o;
+  public:
+    StreamSink(ostream& o) : o(o) {}
+    void write(const char* data, size_t n) { o.write(data, n); }
+    void flush() { o.flush(); }
+    bool binary_safe() const { return true; }
+  };
+
+  // Seconds on the monotonic clock, for flush intervals, rotation and rate
+  // limits. coarse asks for the cheaper, millisecond-grained clock where
+  // the system has one.
+  inline double monotonic_now(bool coarse = false)
+  {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &ts);
+#else
+    (void)coarse;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  // Writes all n bytes to fd, at offset at or, if at is negative, at the
+  // file position, going again after short writes and EINTR. false on any
+  // other error.
+  inline bool write_all(int fd, const char* data, size_t n, off_t at = -1)
+  {
+    while(n) {
+      ssize_t r = at < 0 ? ::write(fd, data, n) : ::pwrite(fd, data, n, at);
+      if(r < 0) {
+        if(errno == EINTR)
+          continue;
+        return false;
+      }
+      data += r;
+      n -= r;
+      if(at >= 0)
+        at += r;
+    }
+    return true;
+  }
+
+  // Buffered sink onto a file descriptor. Lines collect in a user-space
+  // buffer and reach the fd in one write(2) per flush; flushes only ever
+  // happen between lines. By default the buffer is written when full, when
+  // flush() is called and on destruction. More policies can be switched on:
+  //   flush_every(n)        once n bytes are buffered
+  //   flush_on_top_level()  before each new top-level key
+  //   flush_interval(s)     on the first write s seconds after the last flush
+  // The interval is only checked as lines arrive, so after the last line of
+  // a burst the buffer waits for the next one. For a flush on a real timer
+  // put the sink behind AsyncSink(sink, capacity, backpressure, s).
+  class FileSink : public Sink
+  {
+    int fd;
+    bool own_fd;
+    bool ok;
+    string buf;
+    size_t capacity;
+    size_t every_bytes;
+    bool at_top_level;
+    double interval;
+    double last_flush;
+
+    FileSink(const FileSink&);
+    FileSink& operator=(const FileSink&);
+
+    void write_fd(const char* data, size_t n)
     {
-      return string("\"") + str + string("\""); 
+      if(ok)
+        ok = write_all(fd, data, n);
     }
 
-    // escaping borrowed from https://github.com/kazuho/picojson/blob/master/picojson.h
-    // See LICENSE.picojson
-    typedef back_insert_iterator<string> Iter;
-    void static copy(const std::string &s, Iter& oi) {
-      std::copy(s.begin(), s.end(), oi);
+    void init(size_t buffer_size)
+    {
+      capacity = buffer_size;
+      buf.reserve(capacity);
+      every_bytes = 0;
+      at_top_level = false;
+      interval = 0;
+      last_flush = 0;
     }
 
-    struct serialize_str_char {
-      Iter oi;
-      void operator()(char c) {
-        switch (c) {
-#define MAP(val, sym)                           \
-          case val:                             \
-            copy(sym, oi);                      \
-            break
-          MAP('"', "\\\"");
-          MAP('\\', "\\\\");
-          MAP('/', "\\/");
-          MAP('\b', "\\b");
-          MAP('\f', "\\f");
-          MAP('\n', "\\n");
-          MAP('\r', "\\r");
-          MAP('\t', "\\t");
-#undef MAP
-        default:
-          if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
-            char buf[7];
-            snprintf(buf, sizeof(buf), "\\u%04x", c & 0xff);
-            std::copy(buf, buf + 6, oi);
-          } else {
-            *oi++ = c;
-          }
-          break;
+  public:
+    // Appends to path, creating it if needed
+    FileSink(const string& path, size_t buffer_size = 1 << 20)
+      : fd (::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666)),
+        own_fd (true),
+        ok (fd >= 0)
+    {
+      init(buffer_size);
+    }
+
+    // Borrows an already open fd, e.g. 2 for stderr
+    FileSink(int fd, size_t buffer_size = 1 << 20)
+      : fd (fd),
+        own_fd (false),
+        ok (fd >= 0)
+    {
+      init(buffer_size);
+    }
+
+    ~FileSink()
+    {
+      flush();
+      if(own_fd && fd >= 0)
+        ::close(fd);
+    }
+
+    // false once the file could not be opened or a write failed
+    bool good() const { return ok; }
+
+    FileSink& flush_every(size_t bytes) { every_bytes = bytes; return *this; }
+    FileSink& flush_on_top_level(bool on = true) { at_top_level = on; return *this; }
+    FileSink& flush_interval(double seconds)
+    {
+      interval = seconds;
+      last_flush = monotonic_now();
+      return *this;
+    }
+
+    void write(const char* data, size_t n)
+    {
+      if(buf.size() + n > capacity)
+        flush();
+      if(n > capacity)
+        write_fd(data, n);
+      else
+        buf.append(data, n);
+      if(every_bytes && buf.size() >= every_bytes)
+        flush();
+      else if(interval > 0 && monotonic_now() - last_flush >= interval)
+        flush();
+    }
+
+    void flush()
+    {
+      write_fd(buf.data(), buf.size());
+      buf.clear();
+      if(interval > 0)
+        last_flush = monotonic_now();
+    }
+
+    void top_level()
+    {
+      if(at_top_level)
+        flush();
+    }
+
+    bool binary_safe() const { return true; }
+  };
+
+  // Sink that appends by copying into a shared mapping of the file, so a
+  // line costs a memcpy and no system call. The file is grown extent bytes
+  // at a time with posix_fallocate and remapped; what is already written
+  // stays in the file across the remap. Until close() the file carries the
+  // unused, zeroed part of the last extent; close() cuts it off and ends the
+  // document with "...\n" if the log has not already done so, which also
+  // makes it no place for a Recorder.
+  class MmapSink : public Sink
+  {
+    int fd;
+    bool ok;
+    char* map;
+    size_t mapped;
+    size_t used;
+    size_t extent;
+
+    MmapSink(const MmapSink&);
+    MmapSink& operator=(const MmapSink&);
+
+    void unmap()
+    {
+      if(map)
+        munmap(map, mapped);
+      map = 0;
+      mapped = 0;
+    }
+
+    // Makes room for at least size bytes
+    void grow(size_t size)
+    {
+      size_t want = (size + extent - 1) / extent * extent;
+      unmap();
+      // glibc already falls back to writing zeros where the filesystem
+      // can't allocate, so a failure here means no space. A sparse
+      // ftruncate instead would turn that into SIGBUS on the next memcpy.
+      if(posix_fallocate(fd, 0, want) != 0) {
+        ok = false;
+        return;
+      }
+      void* m = mmap(0, want, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if(m == MAP_FAILED) {
+        ok = false;
+        return;
+      }
+      map = static_cast<char*>(m);
+      mapped = want;
+    }
+
+  public:
+    // Appends to path, creating it if needed
+    MmapSink(const string& path, size_t extent = 64 << 20)
+      : fd (::open(path.c_str(), O_RDWR | O_CREAT, 0666)),
+        ok (fd >= 0),
+        map (0),
+        mapped (0),
+        used (0),
+        extent (extent ? extent : 1)
+    {
+      struct stat st;
+      if(ok && fstat(fd, &st) == 0)
+        used = st.st_size;
+      if(ok)
+        grow(used + 1);
+    }
+
+    ~MmapSink()
+    {
+      close();
+    }
+
+    // false once the file could not be opened, grown or mapped
+    bool good() const { return ok; }
+
+    void write(const char* data, size_t n)
+    {
+      if(!ok)
+        return;
+      if(used + n > mapped)
+        grow(used + n);
+      if(!ok)
+        return;
+      memcpy(map + used, data, n);
+      used += n;
+    }
+
+    // Starts writing back what is mapped; readers see it already
+    void flush()
+    {
+      if(map)
+        msync(map, mapped, MS_ASYNC);
+    }
+
+    // Terminates the document and trims the file to what was written,
+    // which after a failed grow is everything before it
+    void close()
+    {
+      if(fd < 0)
+        return;
+      if(ok && (used < 4 || memcmp(map + used - 4, "...\n", 4) != 0))
+        write("...\n", 4);
+      unmap();
+      if(ftruncate(fd, used) != 0)
+        ok = false;
+      ::close(fd);
+      fd = -1;
+    }
+  };
+
+  // Double-buffered sink that hands full buffers to the kernel through
+  // io_uring and goes on filling the other one, so the producer only waits
+  // when the disk falls a whole buffer behind. Where io_uring is missing or
+  // not permitted each buffer is written with pwrite(2) instead; uring()
+  // says which. flush() returns once everything has reached the file.
+  class UringSink : public Sink
+  {
+    int fd;
+    bool ok;
+    off_t offset;           // where the next buffer goes in the file
+    size_t capacity;
+    string buf[2];
+    int active;
+    bool pending[2];
+    off_t pending_off[2];
+
+#ifdef LOG_YAML_URING
+    int ring_fd;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    struct iovec iov[2];
+
+    void setup_ring()
+    {
+      io_uring_params p;
+      memset(&p, 0, sizeof p);
+      ring_fd = syscall(__NR_io_uring_setup, 4, &p);
+      if(ring_fd < 0)
+        return;
+      sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+      sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+      sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd, IORING_OFF_SQ_RING);
+      cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd, IORING_OFF_CQ_RING);
+      void* s = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd, IORING_OFF_SQES);
+      if(sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || s == MAP_FAILED) {
+        if(s != MAP_FAILED)
+          munmap(s, sqes_size);
+        sqes = 0;
+        teardown_ring();
+        return;
+      }
+      char* sq = static_cast<char*>(sq_ptr);
+      char* cq = static_cast<char*>(cq_ptr);
+      sqes = static_cast<io_uring_sqe*>(s);
+      sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+      sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+      sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+      cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+      cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+      cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+      cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    }
+
+    void teardown_ring()
+    {
+      if(sqes)
+        munmap(sqes, sqes_size);
+      if(cq_ptr && cq_ptr != MAP_FAILED)
+        munmap(cq_ptr, cq_size);
+      if(sq_ptr && sq_ptr != MAP_FAILED)
+        munmap(sq_ptr, sq_size);
+      if(ring_fd >= 0)
+        ::close(ring_fd);
+      ring_fd = -1;
+      sqes = 0;
+      sq_ptr = cq_ptr = 0;
+    }
+
+    bool submit(int b)
+    {
+      iov[b].iov_base = const_cast<char*>(buf[b].data());
+      iov[b].iov_len = buf[b].size();
+      unsigned tail = *sq_tail;
+      unsigned i = tail & *sq_mask;
+      io_uring_sqe* e = &sqes[i];
+      memset(e, 0, sizeof *e);
+      e->opcode = IORING_OP_WRITEV;
+      e->fd = fd;
+      e->addr = reinterpret_cast<uintptr_t>(&iov[b]);
+      e->len = 1;
+      e->off = pending_off[b];
+      e->user_data = b;
+      sq_array[i] = i;
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      while(syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, 0, 0) < 0)
+        if(errno != EINTR)
+          return false;
+      return true;
+    }
+
+    // Waits for one completion and finishes its buffer
+    void reap()
+    {
+      unsigned head = *cq_head;
+      while(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        if(syscall(__NR_io_uring_enter, ring_fd, 0, 1,
+                   IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR) {
+          ok = false;
+          pending[0] = pending[1] = false;
+          return;
         }
+      io_uring_cqe* c = &cqes[head & *cq_mask];
+      int b = int(c->user_data);
+      int res = c->res;
+      __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+      pending[b] = false;
+      if(res < 0)
+        ok = false;
+      else if(size_t(res) < buf[b].size())
+        pwrite_all(buf[b].data() + res, buf[b].size() - res, pending_off[b] + res);
+    }
+#endif
+
+    UringSink(const UringSink&);
+    UringSink& operator=(const UringSink&);
+
+    void pwrite_all(const char* data, size_t n, off_t at)
+    {
+      if(ok)
+        ok = write_all(fd, data, n, at);
+    }
+
+    void wait(int b)
+    {
+#ifdef LOG_YAML_URING
+      while(pending[b])
+        reap();
+#else
+      (void)b;
+#endif
+    }
+
+    // Sends the active buffer off and switches to the other one
+    void hand_off()
+    {
+      int b = active;
+      if(buf[b].empty())
+        return;
+      pending_off[b] = offset;
+      offset += buf[b].size();
+      active = 1 - b;
+#ifdef LOG_YAML_URING
+      if(ring_fd >= 0) {
+        if(submit(b))
+          pending[b] = true;
+        else
+          ok = false;
+      }
+      else
+#endif
+        pwrite_all(buf[b].data(), buf[b].size(), pending_off[b]);
+      wait(active);
+      buf[active].clear();
+    }
+
+  public:
+    // Appends to path, creating it if needed. Each of the two buffers
+    // holds buffer_size bytes.
+    UringSink(const string& path, size_t buffer_size = 1 << 20)
+      : fd (::open(path.c_str(), O_WRONLY | O_CREAT, 0666)),
+        ok (fd >= 0),
+        offset (0),
+        capacity (buffer_size),
+        active (0)
+    {
+      pending[0] = pending[1] = false;
+      pending_off[0] = pending_off[1] = 0;
+      buf[0].reserve(capacity);
+      buf[1].reserve(capacity);
+      struct stat st;
+      if(ok && fstat(fd, &st) == 0)
+        offset = st.st_size;
+#ifdef LOG_YAML_URING
+      sq_ptr = cq_ptr = 0;
+      sqes = 0;
+      ring_fd = -1;
+      if(ok)
+        setup_ring();
+#endif
+    }
+
+    ~UringSink()
+    {
+      flush();
+#ifdef LOG_YAML_URING
+      teardown_ring();
+#endif
+      if(fd >= 0)
+        ::close(fd);
+    }
+
+    // false once the file could not be opened or a write failed
+    bool good() const { return ok; }
+
+    // true when writes go through io_uring rather than pwrite(2)
+    bool uring() const
+    {
+#ifdef LOG_YAML_URING
+      return ring_fd >= 0;
+#else
+      return false;
+#endif
+    }
+
+    void write(const char* data, size_t n)
+    {
+      if(buf[active].size() + n > capacity)
+        hand_off();
+      if(n > capacity) {
+        pwrite_all(data, n, offset);
+        offset += n;
       }
+      else
+        buf[active].append(data, n);
+    }
+
+    void flush()
+    {
+      hand_off();
+      wait(0);
+      wait(1);
+    }
+
+    bool binary_safe() const { return true; }
+  };
+
+#ifdef LOG_YAML_THREADS
+  // What AsyncSink does when its queue is full
+  enum Backpressure {
+    BLOCK_WHEN_FULL,  // the producer waits for the writer thread
+    DROP_NEWEST,      // the line being written is discarded
+    DROP_OLDEST       // the oldest queued line is discarded to make room
+  };
+
+  // Moves the I/O of another sink onto a background thread. Producers copy
+  // each finished line into a bounded lock-free multi-producer ring; the
+  // writer thread drains it in batches, handing the target one write() per
+  // batch. flush() returns once everything written before it has reached
+  // the target and the target has been flushed. With flush_interval set the
+  // writer also flushes the target on its own that often.
+  //
+  // Dropping lines keeps producers from ever waiting but the output is then
+  // no longer guaranteed to be a valid document; see dropped().
+  class AsyncSink : public Sink
+  {
+    struct Cell {
+      std::atomic<size_t> seq;
+      string line;
     };
 
-    string serialize_str(const string &instr) {
-      string outstr;
-      Iter oi(outstr);
-      serialize_str_char process_char = {oi};
-      std::for_each(instr.begin(), instr.end(), process_char);
-      return outstr;
+    Sink& target;
+    Backpressure backpressure;
+    double interval;
+    size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    std::atomic<size_t> enqueue_pos;
+    std::atomic<size_t> dequeue_pos;
+    std::atomic<unsigned long long> dropped_lines;
+    std::atomic<unsigned long long> flush_requested;
+    std::atomic<unsigned long long> flush_done;
+    std::atomic<bool> stopping;
+    std::thread writer;
+
+    AsyncSink(const AsyncSink&);
+    AsyncSink& operator=(const AsyncSink&);
+
+    // Bounded MPMC queue after Dmitry Vyukov; only the writer thread pops,
+    // except for producers discarding with DROP_OLDEST. A line is copied
+    // into the cell it claims, whose string keeps the capacity of earlier
+    // lines, so pushing doesn't allocate once the ring is warm.
+    bool try_push(const char* data, size_t n)
+    {
+      size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+      for(;;) {
+        Cell& c = cells[pos & mask];
+        size_t seq = c.seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if(dif == 0) {
+          if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            c.line.assign(data, n);
+            c.seq.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if(dif < 0)
+          return false;
+        else
+          pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
     }
 
-    inline string escaped(const string& str)
+    bool try_pop(string& line)
     {
-      return serialize_str(str);
+      size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+      for(;;) {
+        Cell& c = cells[pos & mask];
+        size_t seq = c.seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(dif == 0) {
+          if(dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            line.swap(c.line);
+            c.line.clear();
+            c.seq.store(pos + mask + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if(dif < 0)
+          return false;
+        else
+          pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
     }
 
-    inline string istr(int i)
+    // An empty line is the marker for Sink::top_level(). DROP_NEWEST never
+    // drops a marker, it waits for room instead; a marker pushed out by
+    // DROP_OLDEST carries no text and isn't counted as a dropped line.
+    void push(const char* data, size_t n)
     {
-      ostringstream o;
-      o << i;
-      return o.str();
+      while(!try_push(data, n)) {
+        if(backpressure == DROP_NEWEST && n) {
+          dropped_lines++;
+          return;
+        }
+        if(backpressure == DROP_OLDEST) {
+          string old;
+          if(try_pop(old) && !old.empty())
+            dropped_lines++;
+        }
+        else
+          std::this_thread::yield();
+      }
+    }
+
+    void run()
+    {
+      string line, batch;
+      double last_flush = monotonic_now();
+      bool dirty = false;
+      for(;;) {
+        unsigned long long requested = flush_requested.load();
+        bool stop = stopping.load();
+        while(try_pop(line)) {
+          if(line.empty()) {
+            target.write(batch.data(), batch.size());
+            batch.clear();
+            target.top_level();
+          }
+          else
+            batch += line;
+          dirty = true;
+          if(batch.size() >= (1 << 16)) {
+            target.write(batch.data(), batch.size());
+            batch.clear();
+          }
+        }
+        if(!batch.empty()) {
+          target.write(batch.data(), batch.size());
+          batch.clear();
+        }
+        // Claimed but not yet published cells mean we are not drained
+        bool drained = dequeue_pos.load() == enqueue_pos.load();
+        if(drained && flush_done.load() < requested) {
+          target.flush();
+          flush_done.store(requested);
+          last_flush = monotonic_now();
+          dirty = false;
+        }
+        if(dirty && interval > 0 && monotonic_now() - last_flush >= interval) {
+          target.flush();
+          last_flush = monotonic_now();
+          dirty = false;
+        }
+        if(drained && stop)
+          break;
+        if(drained)
+          std::this_thread::sleep_for(std::chrono::microseconds(200));
+      }
+      target.flush();
     }
 
-    inline string anon_key() {
-      int anon = next_anon_key_to_try.top();
-      while(used_keys.top().count
-            (istr(anon)))
-        anon++;
-      next_anon_key_to_try.pop();
-      next_anon_key_to_try.push(anon+1);
-      return istr(anon);
+  public:
+    AsyncSink(Sink& target,
+              size_t capacity = 4096,
+              Backpressure backpressure = BLOCK_WHEN_FULL,
+              double flush_interval = 0)
+      : target (target),
+        backpressure (backpressure),
+        interval (flush_interval),
+        enqueue_pos (0),
+        dequeue_pos (0),
+        dropped_lines (0),
+        flush_requested (0),
+        flush_done (0),
+        stopping (false)
+    {
+      size_t n = 2;
+      while(n < capacity)
+        n <<= 1;
+      mask = n - 1;
+      cells.reset(new Cell[n]);
+      for(size_t i = 0; i < n; i++)
+        cells[i].seq.store(i, std::memory_order_relaxed);
+      writer = std::thread(&AsyncSink::run, this);
     }
 
-    inline string key(const string& keystr)
+    ~AsyncSink()
     {
-      string tstr;
-      if(keystr == "")
-        tstr = anon_key();
-      else
-        tstr = keystr;
-      while(used_keys.top().count(tstr))
-        tstr += "'";
-      used_keys.top().insert(tstr);
+      stopping.store(true);
+      writer.join();
+    }
+
+    // Lines discarded by DROP_NEWEST or DROP_OLDEST so far
+    unsigned long long dropped() const { return dropped_lines.load(); }
+
+    void write(const char* data, size_t n)
+    {
+      if(n == 0)
+        return;
+      push(data, n);
+    }
 
-      return quoted(escaped(tstr)) + string(":");
+    void top_level()
+    {
+      push("", 0);
     }
 
-    string headstr;
+    bool binary_safe() const { return target.binary_safe(); }
 
-    string top_key;
+    void flush()
+    {
+      unsigned long long ticket = ++flush_requested;
+      while(flush_done.load() < ticket)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  };
+#endif // LOG_YAML_THREADS
 
+  // What Log keeps in memory for str()
+  enum Retention {
+    RETAIN_ALL,   // every line, str() returns the whole document
+    RETAIN_NONE,  // nothing, lines only go to the sink and str() returns ""
+    RETAIN_TAIL   // flight recorder: the most recent lines in a fixed byte
+                  // budget, dumped as a valid document with their keys
+  };
+
+  // Running statistics of numeric samples in constant memory: count, min,
+  // max, mean and variance (Welford), plus a log-linear histogram with
+  // SUBBUCKETS buckets per power of two. NaNs are ignored. Logged as one
+  // map, either with log(key, stats) or, attached to a scope, by
+  // Log::aggregate().
+  class Stats
+  {
+    unsigned long n;
+    double lo, hi;
+    double m, m2;
+    map<double, unsigned long> buckets;
 
   public:
-    Log(const string& top_key,
-        bool use_stderr=true,
-        const string& stderr_prefix=string("(LOG) "))
-      : use_stderr (use_stderr),
-        stderr_prefix (stderr_prefix),
-        top_key(top_key)
+    static const int SUBBUCKETS = 4;
+
+    Stats() : n(0), lo(0), hi(0), m(0), m2(0) {}
+
+    inline void add(double v)
+    {
+      if(v != v)
+        return;
+      if(n == 0 || v < lo)
+        lo = v;
+      if(n == 0 || v > hi)
+        hi = v;
+      n++;
+      double d = v - m;
+      m += d / n;
+      m2 += d * (v - m);
+      buckets[bucket(v)]++;
+    }
+
+    unsigned long count() const { return n; }
+    double min() const { return lo; }
+    double max() const { return hi; }
+    double mean() const { return m; }
+    // Sample variance, 0 for fewer than two samples
+    double variance() const { return n > 1 ? m2 / (n - 1) : 0; }
+
+    // Lower bound of each occupied bucket (upper for negatives) and its count
+    const map<double, unsigned long>& histogram() const { return buckets; }
+
+    // Where v falls: |v| rounded down to one of SUBBUCKETS steps between
+    // consecutive powers of two, sign kept. 0 and infinities are their own.
+    static double bucket(double v)
+    {
+      if(v == 0 || v - v != 0)
+        return v;
+      int e;
+      double f = frexp(fabs(v), &e);
+      double b = ldexp(0.5 + floor((f - 0.5) * 2 * SUBBUCKETS) / (2 * SUBBUCKETS), e);
+      return v < 0 ? -b : b;
+    }
+  };
+
+  // How much an entry matters. The numbers are what LOG_YAML_MIN_SEVERITY
+  // is compared with.
+  enum Severity {
+    SEVERITY_TRACE = 0,
+    SEVERITY_DEBUG = 1,
+    SEVERITY_INFO = 2,
+    SEVERITY_WARN = 3,
+    SEVERITY_ERROR = 4,
+    SEVERITY_OFF = 5   // as a threshold: nothing gets through
+  };
+
+  // The keys used in one scope, in an open-addressing hash table keyed by
+  // base: the key with its trailing primes taken off. Each base is stored
+  // once, with a span for every key of that family the caller passed: how
+  // many primes the key had and how many names from there on are taken.
+  // Repeats of x become x', x'' ... and only move x's span along; those
+  // names are never stored. A name is taken if one of its base's spans
+  // covers it, so however often a key repeats it takes no more memory.
+  class key_table
+  {
+    struct span {
+      unsigned level;    // primes on the key as passed
+      unsigned primes;   // names level .. level + primes - 1 are taken
+    };
+
+    struct slot {
+      string base;
+      size_t hash;
+      vector<span> spans;
+      bool used;
+      slot() : hash(0), used(false) {}
+    };
+
+    vector<slot> slots;
+    size_t bases;
+    size_t count;
+
+    // FNV-1a
+    static size_t hash_of(const char* k, size_t n)
+    {
+      size_t h = 2166136261u;
+      for(size_t i = 0; i < n; i++) {
+        h ^= static_cast<unsigned char>(k[i]);
+        h *= 16777619u;
+      }
+      return h;
+    }
+
+    size_t probe(const char* k, size_t n, size_t h) const
+    {
+      size_t mask = slots.size() - 1;
+      size_t i = h & mask;
+      while(slots[i].used && (slots[i].hash != h || slots[i].base.size() != n ||
+                              memcmp(slots[i].base.data(), k, n) != 0))
+        i = (i + 1) & mask;
+      return i;
+    }
+
+    void grow()
+    {
+      vector<slot> old(slots.empty() ? 16 : slots.size() * 2);
+      old.swap(slots);
+      for(size_t i = 0; i < old.size(); i++)
+        if(old[i].used) {
+          slot& s = slots[probe(old[i].base.data(), old[i].base.size(), old[i].hash)];
+          s.base.swap(old[i].base);
+          s.spans.swap(old[i].spans);
+          s.hash = old[i].hash;
+          s.used = true;
+        }
+    }
+
+    slot& family(const char* base, size_t n)
+    {
+      if((bases + 1) * 4 > slots.size() * 3)
+        grow();
+      size_t h = hash_of(base, n);
+      slot& s = slots[probe(base, n, h)];
+      if(!s.used) {
+        s.base.assign(base, n);
+        s.hash = h;
+        s.used = true;
+        bases++;
+      }
+      return s;
+    }
+
+    static bool covered(const vector<span>& spans, unsigned level)
+    {
+      for(size_t i = 0; i < spans.size(); i++)
+        if(level >= spans[i].level && level - spans[i].level < spans[i].primes)
+          return true;
+      return false;
+    }
+
+  public:
+    key_table() : bases(0), count(0) {}
+
+    // Takes k for one entry and returns how many primes to append to it
+    // for a name not yet used in this scope. taken says k is already used
+    // in a way the table doesn't know about, by an anonymous key.
+    unsigned take(const string& k, bool taken)
+    {
+      size_t n = k.find_last_not_of('\'') + 1;
+      unsigned level = k.size() - n;
+      slot& s = family(k.data(), n);
+      span* e = 0;
+      for(size_t i = 0; i < s.spans.size(); i++)
+        if(s.spans[i].level == level)
+          e = &s.spans[i];
+      if(!e) {
+        bool free = !taken && !covered(s.spans, level);
+        span fresh = { level, 1 };
+        s.spans.push_back(fresh);
+        count++;
+        if(free)
+          return 0;
+        e = &s.spans.back();
+      }
+      // e's own names are all below level + e->primes
+      unsigned p = e->primes;
+      while(covered(s.spans, level + p))
+        p++;
+      e->primes = p + 1;
+      return p;
+    }
+
+    // Keys passed in, each counted once however often it repeated
+    size_t size() const { return count; }
+  };
+
+  // Retained lines packed into large chunks: appending a line is a memcpy,
+  // not an allocation, and the whole log is one pass away from a string.
+  class line_arena
+  {
+    enum { CHUNK = 64 << 10 };
+
+    deque<string> chunks;
+    size_t total;
+
+  public:
+    line_arena() : total(0) {}
+
+    void append(const char* data, size_t n)
+    {
+      if(chunks.empty() || chunks.back().size() + n > chunks.back().capacity()) {
+        chunks.push_back(string());
+        chunks.back().reserve(std::max(size_t(CHUNK), n));
+      }
+      chunks.back().append(data, n);
+      total += n;
+    }
+
+    size_t size() const { return total; }
+
+    // Chunks only ever split between lines
+    size_t chunk_count() const { return chunks.size(); }
+    const string& chunk(size_t i) const { return chunks[i]; }
+
+    // Reserves room for extra more bytes after the lines, e.g. the "...\n"
+    // str() ends with, so that doesn't reallocate
+    void append_to(string& out, size_t extra = 0) const
+    {
+      out.reserve(out.size() + total + extra);
+      for(deque<string>::const_iterator i = chunks.begin(); i != chunks.end(); i++)
+        out += *i;
+    }
+
+    void clear()
+    {
+      chunks.clear();
+      total = 0;
+    }
+  };
+
+  // Follows a stream of lines and remembers the open() lines enclosing the
+  // latest one, so a document can be picked up again mid-way with a valid
+  // key path above it.
+  class key_path
+  {
+    vector<string> opens;
+
+    static unsigned level_of(const string& line)
+    {
+      size_t i = 0;
+      while(i < line.size() && line[i] == ' ')
+        i++;
+      return i / 2;
+    }
+
+  public:
+    void track(const char* line, size_t n)
+    {
+      if(n == 4 && (memcmp(line, "---\n", 4) == 0 || memcmp(line, "...\n", 4) == 0)) {
+        opens.clear();
+        return;
+      }
+      size_t spaces = 0;
+      while(spaces < n && line[spaces] == ' ')
+        spaces++;
+      unsigned level = spaces / 2;
+      while(!opens.empty() && level_of(opens.back()) >= level)
+        opens.pop_back();
+      // an open() line is the only kind that ends with the key's colon
+      if(n >= 2 && memcmp(line + n - 2, ":\n", 2) == 0)
+        opens.push_back(string(line, n));
+    }
+
+    void track(const string& line)
+    {
+      track(line.data(), line.size());
+    }
+
+    // The open() lines enclosing a line at level
+    void append_to(string& out, unsigned level) const
+    {
+      for(size_t i = 0; i < opens.size() && level_of(opens[i]) < level; i++)
+        out += opens[i];
+    }
+
+    // ... enclosing a line that is itself at level, e.g. one about to start
+    void append_to(string& out, const string& line) const
+    {
+      append_to(out, level_of(line));
+    }
+
+    void clear() { opens.clear(); }
+  };
+
+  // Writes to path and, once the file holds max_bytes or is max_seconds
+  // old, renames it to path.1, path.2, ... and starts a fresh one; zero
+  // turns either limit off. Files are only switched between entries: the old
+  // one is ended with "...", and the new one starts with "---" and the keys
+  // enclosing the next line, so each file is a document of its own. Limits
+  // are checked as lines arrive. To keep the renames off the logging
+  // thread, put an AsyncSink in front. Lines only: a Recorder can't use it.
+  class RotatingSink : public Sink
+  {
+    string path;
+    size_t max_bytes;
+    double max_seconds;
+    size_t buffer_size;
+    FileSink* file;
+    size_t bytes;
+    double opened;
+    unsigned next_number;
+    bool terminated;
+    bool in_sequence;   // inside a chunked container, see set_chunk_size()
+    key_path keys;
+    string header;
+    string partial;     // a line still waiting for its newline
+
+    RotatingSink(const RotatingSink&);
+    RotatingSink& operator=(const RotatingSink&);
+
+    void open_file()
+    {
+      file = new FileSink(path, buffer_size);
+      bytes = 0;
+      opened = monotonic_now();
+    }
+
+    bool due() const
+    {
+      return bytes > 0 && ((max_bytes && bytes >= max_bytes) ||
+                           (max_seconds > 0 && monotonic_now() - opened >= max_seconds));
+    }
+
+    // Switches files ahead of line
+    void rotate(const char* line, size_t n)
+    {
+      if(!terminated)
+        file->write("...\n", 4);
+      delete file;
+      string old;
+      struct stat st;
+      do {
+        ostringstream o;
+        o << path << '.' << next_number++;
+        old = o.str();
+      } while(stat(old.c_str(), &st) == 0);
+      ::rename(path.c_str(), old.c_str());
+      open_file();
+      if(n == 4 && memcmp(line, "---\n", 4) == 0)
+        return;
+      header.assign("---\n");
+      keys.append_to(header, string(line, n));
+      file->write(header.data(), header.size());
+      bytes += header.size();
+    }
+
+    // One complete line
+    void put_line(const char* line, size_t len)
+    {
+      bool end = len == 4 && memcmp(line, "...\n", 4) == 0;
+      if(!end && !in_sequence && due())
+        rotate(line, len);
+      file->write(line, len);
+      bytes += len;
+      terminated = end;
+      in_sequence = len >= 2 && line[len - 2] == ',';
+      keys.track(line, len);
+    }
+
+  public:
+    RotatingSink(const string& path,
+                 size_t max_bytes,
+                 double max_seconds = 0,
+                 size_t buffer_size = 1 << 16)
+      : path (path),
+        max_bytes (max_bytes),
+        max_seconds (max_seconds),
+        buffer_size (buffer_size),
+        next_number (1),
+        terminated (false),
+        in_sequence (false)
+    {
+      open_file();
+    }
+
+    ~RotatingSink()
+    {
+      file->write(partial.data(), partial.size());
+      delete file;
+    }
+
+    // false once the current file could not be opened or written
+    bool good() const { return file->good(); }
+
+    // Handed anything but whole lines, it keeps the piece after the last
+    // newline until the rest of that line arrives
+    void write(const char* data, size_t n)
+    {
+      while(n) {
+        const char* nl = static_cast<const char*>(memchr(data, '\n', n));
+        size_t len = nl ? nl - data + 1 : n;
+        if(nl && partial.empty())
+          put_line(data, len);
+        else {
+          partial.append(data, len);
+          if(nl) {
+            put_line(partial.data(), partial.size());
+            partial.clear();
+          }
+        }
+        data += len;
+        n -= len;
+      }
+    }
+
+    void flush() { file->flush(); }
+
+    void top_level() { file->top_level(); }
+  };
+
+  // Flight recorder: the most recent complete lines in a fixed-size byte
+  // ring. Lines pushed out of the ring pass through a key_path, so dump()
+  // can put the enclosing keys back above the oldest surviving line and
+  // the result is a valid document.
+  class line_ring
+  {
+    vector<char> buf;
+    size_t head;
+    size_t used;
+    key_path evicted;
+    string scratch;
+
+    void copy_in(const char* data, size_t n)
+    {
+      size_t at = (head + used) % buf.size();
+      size_t first = std::min(n, buf.size() - at);
+      memcpy(&buf[at], data, first);
+      memcpy(&buf[0], data + first, n - first);
+      used += n;
+    }
+
+    void copy_out(string& out, size_t from, size_t n) const
+    {
+      size_t at = (head + from) % buf.size();
+      size_t first = std::min(n, buf.size() - at);
+      out.append(&buf[at], first);
+      out.append(&buf[0], n - first);
+    }
+
+    // Length of the oldest line, newline included
+    size_t oldest_size() const
+    {
+      size_t n = 0;
+      while(buf[(head + n) % buf.size()] != '\n')
+        n++;
+      return n + 1;
+    }
+
+    // Pushes out the oldest entry. A chunked container goes as a whole:
+    // if its last line has not arrived yet, cut drops the rest on arrival.
+    void evict()
+    {
+      do {
+        size_t n = oldest_size();
+        scratch.clear();
+        copy_out(scratch, 0, n);
+        evicted.track(scratch);
+        head = (head + n) % buf.size();
+        used -= n;
+        cut = continued(scratch.data(), scratch.size());
+      } while(cut && used);
+    }
+
+    bool cut;
+
+  public:
+    line_ring() : head(0), used(0), cut(false) {}
+
+    // A line ending in a comma is followed by more of the same flow sequence
+    static bool continued(const char* line, size_t n)
+    {
+      return n >= 2 && line[n - 2] == ',';
+    }
+
+    // Starts over empty, as if the lines in path had been pushed out
+    void reset(size_t capacity, const vector<string>& path)
+    {
+      vector<char>(capacity).swap(buf);
+      clear();
+      for(size_t i = 0; i < path.size(); i++)
+        evicted.track(path[i]);
+    }
+
+    void clear()
+    {
+      head = 0;
+      used = 0;
+      cut = false;
+      evicted.clear();
+    }
+
+    size_t size() const { return used; }
+
+    // One complete line
+    void push(const char* line, size_t n)
+    {
+      if(n > buf.size())
+        while(used)
+          evict();
+      else
+        while(!cut && buf.size() - used < n)
+          evict();
+      if(cut || n > buf.size()) {
+        evicted.track(line, n);
+        cut = continued(line, n);
+        return;
+      }
+      copy_in(line, n);
+    }
+
+    // Always a document: with nothing left in the ring, just "---" and the
+    // keys still open
+    void dump(string& out) const
+    {
+      if(!used) {
+        out += "---\n";
+        evicted.append_to(out, ~0u);
+        return;
+      }
+      string oldest;
+      copy_out(oldest, 0, oldest_size());
+      if(oldest != "---\n") {
+        out += "---\n";
+        evicted.append_to(out, oldest);
+      }
+      copy_out(out, 0, used);
+    }
+  };
+
+  // Hands out anonymous keys "0", "1", ... for one scope, skipping numbers
+  // already used as explicit keys. Only explicit numeric keys at or past
+  // the cursor are remembered, and each is stepped over once, so the next
+  // anonymous key costs amortized O(1) and allocates nothing.
+  struct anon_keys
+  {
+    unsigned next;
+    set<unsigned> taken;
+
+    anon_keys() : next(0) {}
+
+    unsigned allocate()
+    {
+      while(!taken.empty() && *taken.begin() == next) {
+        taken.erase(taken.begin());
+        next++;
+      }
+      return next++;
+    }
+
+    // Note an explicit key; true if an anonymous key has already taken it
+    bool use(const string& k)
+    {
+      // canonical decimal only: "7" collides with anonymous 7, "07" doesn't
+      if(k.empty() || k.size() > 10 || (k[0] == '0' && k.size() > 1))
+        return false;
+      unsigned long v = 0;
+      for(size_t i = 0; i < k.size(); i++) {
+        if(k[i] < '0' || k[i] > '9')
+          return false;
+        v = v * 10 + (k[i] - '0');
+      }
+      if(v < next)
+        return true;
+      if(v <= 0xffffffffUL)
+        taken.insert(static_cast<unsigned>(v));
+      return false;
+    }
+  };
+
+#ifdef LOG_YAML_THREADS
+  // Threads that are joined when the group goes out of scope, however it
+  // is left, so a throw while they run can't end in std::terminate
+  class thread_group
+  {
+    vector<std::thread> threads;
+
+    thread_group(const thread_group&);
+    thread_group& operator=(const thread_group&);
+
+  public:
+    thread_group() {}
+
+    ~thread_group() { join(); }
+
+    template<typename F>
+    void start(F f)
+    {
+      threads.push_back(std::thread(f));
+    }
+
+    void join()
+    {
+      for(size_t i = 0; i < threads.size(); i++)
+        if(threads[i].joinable())
+          threads[i].join();
+    }
+  };
+#endif
+
+  class Log
+  {
+  private:
+    bool use_stderr;
+    line_arena arena;
+    line_ring ring;
+    vector<string> open_lines;
+    string stderr_prefix;
+    Sink* sink;
+    Retention retention;
+    size_t tail_bytes;
+    FloatFormat float_format;
+    Severity threshold;
+    size_t chunk_elements;
+    unsigned format_threads;
+    size_t parallel_min;
+    stack<key_table> used_keys;
+    stack<anon_keys> next_anon_key;
+
+    // Spaces for the deepest level reached so far, grown by open(). Every
+    // line's indentation is a prefix of it.
+    string indentation;
+
+    inline void indent(string& o)
+    {
+      o.append(indentation, 0, 2 * level);
+    }
+
+    inline void debug_line(const string &line) {
+      if(sink)
+        sink->write(line.data(), line.size());
+      else if(use_stderr)
+        cerr << line;
+    }
+
+    // One or more complete lines
+    inline void retain(const string &line) {
+      if(retention == RETAIN_ALL)
+        arena.append(line.data(), line.size());
+      else if(retention == RETAIN_TAIL)
+        for(size_t i = 0, n; i < line.size(); i += n) {
+          n = line.find('\n', i) - i + 1;
+          ring.push(line.data() + i, n);
+        }
+    }
+
+    inline void emit_text(const string &lines) {
+      retain(lines);
+      debug_line(lines);
+    }
+
+    inline void emit_line(const string &line) {
+      if(sink && level == 1)
+        sink->top_level();
+      emit_text(line);
+    }
+
+    // Reused for every line, so formatting allocates only while it grows
+    string linebuf;
+
+    template<typename T>
+    inline void entry(const string& keystr, const T& t)
+    {
+      is_arithmetic<T> x;
+      is_container<T> y;
+      linebuf.clear();
+      log_specialize(keystr, t, x, y);
+      // empty when a chunked container has written itself
+      if(!linebuf.empty())
+        emit_line(linebuf);
+    }
+
+    unsigned level;
+    // close() never goes above this. Blocks start deeper and have no header.
+    unsigned base_level;
+    bool detached;
+
+    // Logs from spawn() not merged back yet, oldest first. Each keeps its
+    // key line in headstr.
+    list<Log> children;
+
+    // Stats from aggregate() still collecting, oldest first
+    struct pending_stats {
+      string key_line;
+      unsigned level;
+      Stats stats;
+    };
+    list<pending_stats> aggregates;
+
+    // Lines for stats' map, at level at
+    inline void append_stats(string& o, const Stats& stats, unsigned at)
+    {
+      string pad(2 * at, ' ');
+      o += pad;
+      o += "\"count\": ";
+      append_number(o, stats.count());
+      o += '\n';
+      if(!stats.count())
+        return;
+      o += pad;
+      o += "\"min\": ";
+      append_number(o, stats.min());
+      o += '\n';
+      o += pad;
+      o += "\"max\": ";
+      append_number(o, stats.max());
+      o += '\n';
+      o += pad;
+      o += "\"mean\": ";
+      append_number(o, stats.mean());
+      o += '\n';
+      o += pad;
+      o += "\"variance\": ";
+      append_number(o, stats.variance());
+      o += '\n';
+      o += pad;
+      o += "\"histogram\":\n";
+      const map<double, unsigned long>& h = stats.histogram();
+      char buf[FLOAT_BUFSIZE];
+      for(map<double, unsigned long>::const_iterator i = h.begin(); i != h.end(); ++i) {
+        o += pad;
+        o += "  \"";
+        o.append(buf, format_double(buf, i->first, FLOAT_SHORTEST));
+        o += "\": ";
+        append_number(o, i->second);
+        o += '\n';
+      }
+    }
+
+    // Merges the children spawned at level from or deeper and writes out
+    // the Stats aggregated there. Scopes still open at those levels are
+    // nested, so the deepest level goes first: its entries belong at the
+    // end of the innermost scope, the shallower ones after it. Within a
+    // level children go in spawn order, then Stats.
+    inline void join_from(unsigned from)
+    {
+      unsigned deepest = from;
+      for(list<Log>::iterator i = children.begin(); i != children.end(); ++i)
+        deepest = std::max(deepest, i->base_level - 1);
+      for(list<pending_stats>::iterator i = aggregates.begin(); i != aggregates.end(); ++i)
+        deepest = std::max(deepest, i->level);
+      for(unsigned at = deepest + 1; at-- > from;) {
+        for(list<Log>::iterator i = children.begin(); i != children.end();) {
+          if(i->base_level - 1 != at) {
+            ++i;
+            continue;
+          }
+          i->join_from(0);
+          if(sink && i->base_level == 2)
+            sink->top_level();
+          emit_text(i->headstr);
+          for(size_t c = 0; c < i->arena.chunk_count(); c++)
+            emit_text(i->arena.chunk(c));
+          i = children.erase(i);
+        }
+        for(list<pending_stats>::iterator i = aggregates.begin(); i != aggregates.end();) {
+          if(i->level != at) {
+            ++i;
+            continue;
+          }
+          if(sink && i->level == 1)
+            sink->top_level();
+          string text(i->key_line);
+          append_stats(text, i->stats, i->level + 1);
+          emit_text(text);
+          i = aggregates.erase(i);
+        }
+      }
+    }
+
+    // An empty block for lines at level, formatted like parent
+    Log(const Log& parent, unsigned level)
+      : use_stderr (false),
+        sink (0),
+        retention (RETAIN_ALL),
+        tail_bytes (0),
+        float_format (parent.float_format),
+        threshold (parent.threshold),
+        chunk_elements (parent.chunk_elements),
+        format_threads (parent.format_threads),
+        parallel_min (parent.parallel_min),
+        base_level (level),
+        detached (true)
+    {
+        clear();
+    }
+
+    // Moves every line in text by shift levels
+    static void reindent(string& out, const string& text, int shift)
+    {
+      for(size_t i = 0, n; i < text.size(); i += n) {
+        n = text.find('\n', i) - i + 1;
+        size_t skip = 0;
+        if(shift > 0)
+          out.append(2 * shift, ' ');
+        else
+          while(skip < 2 * size_t(-shift) && text[i + skip] == ' ')
+            skip++;
+        out.append(text, i + skip, n - skip);
+      }
+    }
+
+    inline string quoted(const string& str)
+    {
+      return string("\"") + str + string("\""); 
+    }
+
+    string serialize_str(const string &instr) {
+      string outstr;
+      escape_append(outstr, instr.data(), instr.size());
+      return outstr;
+    }
+
+    inline string escaped(const string& str)
+    {
+      return serialize_str(str);
+    }
+
+    // char* and string literals are escaped in place, not copied first
+    inline void append_quoted(string& o, const char* str)
+    {
+      o += '"';
+      escape_append(o, str, strlen(str));
+      o += '"';
+    }
+
+    inline void append_quoted(string& o, const string& str)
+    {
+      o += '"';
+      escape_append(o, str.data(), str.size());
+      o += '"';
+    }
+
+    inline string istr(unsigned i)
+    {
+      char buf[INT_BUFSIZE];
+      return string(buf, format_integer(buf, i));
+    }
+
+    template<typename T>
+    inline void append_number(string& o, T v)
+    {
+      char buf[INT_BUFSIZE];
+      o.append(buf, format_integer(buf, v));
+    }
+
+    inline void append_number(string& o, double v)
+    {
+      char buf[FLOAT_BUFSIZE];
+      o.append(buf, format_double(buf, v, float_format));
+    }
+
+    inline void append_number(string& o, float v)
+    {
+      char buf[FLOAT_BUFSIZE];
+      o.append(buf, format_float(buf, v, float_format));
+    }
+
+    // Appends the unique, quoted key and its colon. Anonymous keys are
+    // always fresh, so they are not remembered: anon_keys knows every
+    // number below its cursor is taken.
+    inline void key(string& o, const string& keystr)
+    {
+      if(keystr == "") {
+        o += '"';
+        append_number(o, next_anon_key.top().allocate());
+        o += "\":";
+        return;
+      }
+      unsigned primes = used_keys.top().take(keystr, next_anon_key.top().use(keystr));
+      o += '"';
+      escape_append(o, keystr.data(), keystr.size());
+      o.append(primes, '\'');
+      o += "\":";
+    }
+
+    string headstr;
+
+    string top_key;
+
+
+  public:
+    Log(const string& top_key,
+        bool use_stderr=true,
+        const string& stderr_prefix=string("(LOG) "))
+      : use_stderr (use_stderr),
+        stderr_prefix (stderr_prefix),
+        sink (0),
+        retention (RETAIN_ALL),
+        tail_bytes (0),
+        float_format (FLOAT_SHORTEST),
+        threshold (SEVERITY_TRACE),
+        chunk_elements (0),
+        format_threads (1),
+        parallel_min (0),
+        base_level (1),
+        detached (false),
+        top_key(top_key)
+    {
+        clear();
+    }
+
+    // Stream every line to sink as it is created. With the default
+    // RETAIN_NONE nothing is kept, so memory stays flat however long the
+    // run; RETAIN_TAIL keeps the last tail_bytes of lines for str().
+    Log(const string& top_key,
+        Sink& sink,
+        Retention retention=RETAIN_NONE,
+        size_t tail_bytes=0)
+      : use_stderr (false),
+        sink (&sink),
+        retention (retention),
+        tail_bytes (tail_bytes),
+        float_format (FLOAT_SHORTEST),
+        threshold (SEVERITY_TRACE),
+        chunk_elements (0),
+        format_threads (1),
+        parallel_min (0),
+        base_level (1),
+        detached (false),
+        top_key(top_key)
+    {
+        clear();
+    }
+
+    // Takes effect from the next line on. Switching to another kind of
+    // retention drops what was kept so far.
+    inline void set_retention(Retention r, size_t tail=0)
+    {
+      if(r != retention || tail != tail_bytes) {
+        arena.clear();
+        ring.reset(r == RETAIN_TAIL ? tail : 0, open_lines);
+      }
+      retention = r;
+      tail_bytes = tail;
+    }
+
+    // Memory held for str(), in bytes of log text
+    inline size_t retained_bytes() const
+    {
+      return retention == RETAIN_ALL ? arena.size() : ring.size();
+    }
+
+    // Keys the current scope remembers to tell repeats apart. Anonymous
+    // keys are not among them.
+    inline size_t remembered_keys() const
+    {
+      return used_keys.top().size();
+    }
+
+    // FLOAT_LEGACY brings back the old 6-digit output
+    inline void set_float_format(FloatFormat f)
+    {
+      float_format = f;
+    }
+
+    // Containers with more than n elements are written n to a line, as a
+    // flow sequence spread over several lines, each line going to the sink
+    // as soon as it is formatted. log() returns "" for them. 0, the
+    // default, keeps every container on one line.
+    inline void set_chunk_size(size_t n)
+    {
+      chunk_elements = n;
+    }
+
+#ifdef LOG_YAML_THREADS
+    // Numeric vectors of at least min_elements are formatted by threads
+    // threads, or as many as there are cores if that is fewer, each taking
+    // an equal slice, and come out byte for byte as they would from one. 1, the default, formats everything on the
+    // calling thread. Chunked containers are always formatted serially.
+    inline void set_format_threads(unsigned threads, size_t min_elements = 100000)
+    {
+      format_threads = threads ? threads : 1;
+      parallel_min = min_elements;
+    }
+#endif
+
+    // Entries made through LOG_YAML_TRACE ... LOG_YAML_ERROR below s are
+    // skipped before any formatting
+    inline void set_threshold(Severity s)
+    {
+      threshold = s;
+    }
+
+    inline bool enabled(Severity s) const
+    {
+      return s >= threshold;
+    }
+
+    inline void flush()
+    {
+      if(sink)
+        sink->flush();
+    }
+
+    inline void clear()
+    {
+      level = 0;
+      used_keys = stack<key_table>();
+      used_keys.push(key_table());
+      next_anon_key = stack<anon_keys>();
+      next_anon_key.push(anon_keys());
+      // lines.clear();
+      arena.clear();
+      open_lines.clear();
+      ring.reset(retention == RETAIN_TAIL ? tail_bytes : 0, open_lines);
+      children.clear();
+      aggregates.clear();
+      if(detached) {
+        level = base_level;
+        if(indentation.size() < 2 * level)
+          indentation.resize(2 * level, ' ');
+        return;
+      }
+      emit_line("---\n");
+      headstr = string("---\n") + open(top_key);
+    }
+
+    // A detached Log for one entry at the current level: it has no header
+    // and no sink, and only keeps its lines until splice() publishes them.
+    // Filling a block touches nothing shared, so each thread can have its
+    // own; see SharedLog.
+    inline Log block() const
+    {
+      return Log(*this, level + 1);
+    }
+
+    // Writes keystr at the current level with block's lines under it, all
+    // in one go, then empties block for reuse. Anything spawned or
+    // aggregated in the block goes along. If the log has gone deeper or
+    // shallower since the block was made its lines are moved to fit.
+    inline void splice(const string& keystr, Log& block)
+    {
+      block.join_from(0);
+      linebuf.clear();
+      indent(linebuf);
+      key(linebuf, keystr);
+      linebuf += '\n';
+      emit_line(linebuf);
+      int shift = int(level + 1) - int(block.base_level);
+      for(size_t i = 0; i < block.arena.chunk_count(); i++) {
+        const string& lines = block.arena.chunk(i);
+        if(shift == 0)
+          emit_text(lines);
+        else {
+          linebuf.clear();
+          reindent(linebuf, lines, shift);
+          emit_text(linebuf);
+        }
+      }
+      block.clear();
+    }
+
+    // A child Log for keystr, which is taken in the current scope now, so
+    // its name doesn't depend on when the child finishes. The child keeps
+    // its own keys and lines, so another thread can fill it while this Log
+    // carries on. Children are merged back in the order they were spawned
+    // when this scope closes, or by join(), str() or terminator(); the
+    // child must be finished by then. The reference stays valid until the
+    // merge.
+    inline Log& spawn(const string& keystr)
     {
-        clear();
+      linebuf.clear();
+      indent(linebuf);
+      key(linebuf, keystr);
+      linebuf += '\n';
+      children.push_back(Log(*this, level + 1));
+      children.back().headstr = linebuf;
+      return children.back();
     }
 
-    inline void clear()
+    // Stats for samples logged under keystr, which is taken in the current
+    // scope now. Instead of a line per sample, one map is written when the
+    // scope closes (or on join(), str() or terminator()), after any
+    // children. The reference stays valid until then.
+    inline Stats& aggregate(const string& keystr)
     {
-      level = 0;
-      used_keys = stack<set<string> >();
-      used_keys.push(set<string>());
-      next_anon_key_to_try = stack<unsigned>(); 
-      next_anon_key_to_try.push(0);
-      // lines.clear();
-      lines = vector<string>();
-      lines.push_back("---\n");
-      debug_line("---\n");
-      headstr = string("---\n") + open(top_key);
+      linebuf.clear();
+      indent(linebuf);
+      key(linebuf, keystr);
+      linebuf += '\n';
+      aggregates.push_back(pending_stats());
+      aggregates.back().key_line = linebuf;
+      aggregates.back().level = level;
+      return aggregates.back().stats;
+    }
+
+    // Merges the children spawned and writes the Stats aggregated in the
+    // current scope
+    inline void join()
+    {
+      join_from(level);
     }
 
     inline string header()
@@ -242,6 +2288,7 @@ typedef integral_constant<bool, false> false_type;
 
     inline string terminator()
     {
+        join_from(0);
         string termstr = "...\n";
         debug_line(termstr);
         return termstr;
@@ -300,123 +2347,272 @@ typedef integral_constant<bool, false> false_type;
       vector<string> r;
       for(typename vector<T>::const_iterator i = vt.begin();
           i != vt.end(); i++) {
-        ostringstream o;
-        o << (*i);
-        r.push_back(o.str());
+        string o;
+        append_number(o, *i);
+        r.push_back(o);
       }
       return r;
     }
 
+    // One container element: numbers as is, strings quoted and escaped,
+    // anything else (long long, bool, char ...) the way ostream writes it
+    template<typename T>
+    inline void append_element(string& o, const T& v, const true_type&)
+    {
+      append_number(o, v);
+    }
+
+    template<typename T>
+    inline void append_element(string& o, const T& v, const false_type&)
+    {
+      ostringstream s;
+      s << v;
+      o += s.str();
+    }
+
+    inline void append_element(string& o, const string& str, const false_type&)
+    {
+      append_quoted(o, str);
+    }
+
+    inline void append_element(string& o, const char* str, const false_type&)
+    {
+      append_quoted(o, str);
+    }
+
+    inline void append_element(string& o, char* str, const false_type&)
+    {
+      append_quoted(o, str);
+    }
+
+    // Formats straight from the container's iterators, no copies
+    template<typename I>
+    inline void append_elements(string& o, I first, I last)
+    {
+      is_arithmetic<typename std::iterator_traits<I>::value_type> x;
+      for(I i = first; i != last; ++i) {
+        if(i != first)
+          o += ", ";
+        append_element(o, *i, x);
+      }
+    }
+
+    // The log_specialize overloads append one entry to linebuf
+
+    // Writes the elements chunk_elements to a line, each line as soon as
+    // it is full, so only one line is held at a time. Continuation lines
+    // are indented one level; every line but the last ends with a comma.
+    // Leaves linebuf empty.
+    template<typename I>
+    inline void append_chunked(I first, I last)
+    {
+      is_arithmetic<typename std::iterator_traits<I>::value_type> x;
+      bool head = true;
+      size_t k = 0;
+      for(I i = first; i != last;) {
+        append_element(linebuf, *i, x);
+        if(++i == last)
+          break;
+        if(++k < chunk_elements) {
+          linebuf += ", ";
+          continue;
+        }
+        linebuf += ",\n";
+        if(head)
+          emit_line(linebuf);
+        else
+          emit_text(linebuf);
+        head = false;
+        k = 0;
+        linebuf.clear();
+        indent(linebuf);
+        linebuf += "  ";
+      }
+      linebuf += "]\n";
+      if(head)
+        emit_line(linebuf);
+      else
+        emit_text(linebuf);
+      linebuf.clear();
+    }
+
+#ifdef LOG_YAML_THREADS
+    // Elements [from, to) of v as append_elements() would write them
+    // within the whole container
+    template<typename T, typename A>
+    inline void append_range(string& o, const vector<T, A>& v, size_t from, size_t to)
+    {
+      if(from > 0 && from < to)
+        o += ", ";
+      append_elements(o, v.begin() + from, v.begin() + to);
+    }
+
+    // Splits a big numeric vector into one range per thread, formats each
+    // into its own buffer and appends them in order. No more threads than
+    // the machine has cores. false if v is not worth it, and nothing was
+    // written.
+    template<typename T, typename A>
+    inline bool append_parallel(string& o, const vector<T, A>& v)
+    {
+      size_t n = v.size();
+      unsigned k = format_threads;
+      unsigned cores = std::thread::hardware_concurrency();
+      if(cores && k > cores)
+        k = cores;
+      if(k < 2 || n < parallel_min || !is_arithmetic<T>::value)
+        return false;
+      vector<string> parts(k);
+      {
+        thread_group pool;
+        for(unsigned t = 1; t < k; t++)
+          pool.start([this, &parts, &v, n, k, t] {
+              append_range(parts[t], v, n * t / k, n * (t + 1) / k);
+            });
+        append_range(o, v, 0, n / k);
+      }
+      for(unsigned t = 1; t < k; t++)
+        o += parts[t];
+      return true;
+    }
+
+    template<typename V>
+    inline bool append_parallel(string&, const V&)
+    {
+      return false;
+    }
+#endif
+
     template <typename V>
-    inline string log_specialize(const string keystr, const V& t, const false_type&, const true_type&)
+    inline void log_specialize(const string& keystr, const V& t, const false_type&, const true_type&)
     {
-      vector<typename std::iterator_traits<typename V::const_iterator>::value_type> v(t.begin(), t.end());
-      ostringstream o;
-      o << indent()
-        << key(keystr)
-        << " "
-        << bracket(comma_sep(to_strings(v)))
-        << endl;
-      lines.push_back(o.str());
-      debug_line(o.str());
-      return o.str();
+      indent(linebuf);
+      key(linebuf, keystr);
+      linebuf += " [";
+      if(chunk_elements && t.size() > chunk_elements) {
+        append_chunked(t.begin(), t.end());
+        return;
+      }
+#ifdef LOG_YAML_THREADS
+      if(!append_parallel(linebuf, t))
+#endif
+        append_elements(linebuf, t.begin(), t.end());
+      linebuf += "]\n";
     }
 
     template<typename T>
-    inline string log_specialize(const string& keystr, T d, const true_type&, const false_type&)
+    inline void log_specialize(const string& keystr, T d, const true_type&, const false_type&)
     {
-      ostringstream o;
-      o << indent()
-        << key(keystr)
-        << " "
-        << d
-        << endl;
-      lines.push_back(o.str());
-      debug_line(o.str());
-      return o.str();
+      indent(linebuf);
+      key(linebuf, keystr);
+      linebuf += ' ';
+      append_number(linebuf, d);
+      linebuf += '\n';
+    }
+
+    // Stats, as a map
+    inline void log_specialize(const string& keystr, const Stats& stats, const false_type&, const false_type&)
+    {
+      indent(linebuf);
+      key(linebuf, keystr);
+      linebuf += '\n';
+      append_stats(linebuf, stats, level + 1);
+    }
+
+    // string-like
+    template<typename T>
+    inline void log_specialize(const string& keystr, const T& str, const false_type&, const false_type&)
+    {
+      indent(linebuf);
+      key(linebuf, keystr);
+      linebuf += ' ';
+      append_quoted(linebuf, str);
+      linebuf += '\n';
     }
 
+    // Arguments are taken by reference, so logging a container never
+    // copies it
     template<typename T>
-    inline string log(const string& keystr, const T t)
+    inline string log(const string& keystr, const T& t)
     {
-        typedef is_arithmetic<T> truth_type;
-        typedef is_container<T> container_truth_type;
-        truth_type x;
-        container_truth_type y;
-        return log_specialize(keystr, t, x, y);
+      entry(keystr, t);
+      return linebuf;
     }
 
     template<typename T>
-    inline string log(const T t)
+    inline string log(const T& t)
     {
-      typedef is_arithmetic<T> truth_type;
-      typedef is_container<T> container_truth_type;
-      truth_type x;
-      container_truth_type y;
-      return log_specialize(string(""), t, x, y);
+      entry(string(""), t);
+      return linebuf;
     }
 
     // operator () as alias for Log::log
     template<typename T>
-    inline string operator ()(const T t)
+    inline string operator ()(const T& t)
     {
         return log(t);
     }
 
     template<typename T>
-    inline string operator ()(const string& keystr, const T t)
+    inline string operator ()(const string& keystr, const T& t)
     {
         return log(keystr, t);
     }
 
-    // string-like
+    // Fast path: same as log() but returns nothing, so the line goes from
+    // Log's reused buffer to the sink without a copy being handed back
     template<typename T>
-    inline string log_specialize(const string& keystr, const T& str, const false_type&, const false_type&)
+    inline void emit(const string& keystr, const T& t)
     {
-      ostringstream o;
-      o << indent()
-        << key(keystr)
-        << " "
-        << quoted(escaped(str))
-        << endl;
-      lines.push_back(o.str());
-      debug_line(o.str());
-      return o.str();
+      entry(keystr, t);
     }
 
+    template<typename T>
+    inline void emit(const T& t)
+    {
+      entry(string(""), t);
+    }
 
     inline string open(const string& str)
     {
-      ostringstream o;
-      o << indent()
-        << key(str)
-        << endl;
-      lines.push_back(o.str());
-      debug_line(o.str());
+      linebuf.clear();
+      indent(linebuf);
+      key(linebuf, str);
+      linebuf += '\n';
+      emit_line(linebuf);
+      open_lines.push_back(linebuf);
       level++;
-      used_keys.push(set<string>());
-      next_anon_key_to_try.push(0);
-      return o.str();
+      if(indentation.size() < 2 * level)
+        indentation.resize(2 * level, ' ');
+      used_keys.push(key_table());
+      next_anon_key.push(anon_keys());
+      return linebuf;
     }
 
     inline string close()
     {
-      if(level == 1) return string("");
+      if(level <= base_level) return string("");
+      join_from(level);
       level--;
+      open_lines.pop_back();
       used_keys.pop();
-      next_anon_key_to_try.pop();
+      next_anon_key.pop();
       return string("");
     }
 
+    // The retained document. Empty with RETAIN_NONE; with RETAIN_TAIL the
+    // recent lines under their re-emitted keys.
     inline string str()
     {
-      ostringstream ostr;
-      for(vector<string>::const_iterator i = lines.begin();
-          i != lines.end();
-          i++)
-        ostr << (*i);
-      ostr << "...\n";
-      return ostr.str();
+      join();
+      if(retention == RETAIN_NONE)
+        return string("");
+      string ostr;
+      if(retention == RETAIN_ALL)
+        arena.append_to(ostr, 4);
+      else
+        ring.dump(ostr);
+      ostr += "...\n";
+      return ostr;
     }
 
     inline string logf(const string& keystr, const char* format, ...)
@@ -434,7 +2630,633 @@ typedef integral_constant<bool, false> false_type;
     }
 
   };
+
+  // How a Sampler picks the events that get logged
+  enum SampleMode {
+    SAMPLE_EVERY_N,   // the 1st, n+1th, 2n+1th ...
+    SAMPLE_BACKOFF,   // the first n, then the 2nth, 4nth, 8nth ...
+    SAMPLE_RATE       // token bucket: n per second, bursts of up to burst
+  };
+
+  class Sampler;
+
+  // Every live Sampler, oldest first, for report_suppressed()
+  inline Sampler*& sampler_list()
+  {
+    static Sampler* head = 0;
+    return head;
+  }
+
+#ifdef LOG_YAML_THREADS
+  // Guards sampler_list(): call sites on different threads may register
+  // their Samplers at the same time
+  inline std::mutex& sampler_list_lock()
+  {
+    static std::mutex m;
+    return m;
+  }
+#endif
+
+  // Decides, per call site, whether an event is logged, and counts the
+  // ones it holds back. sample() is a counter check, or with SAMPLE_RATE a
+  // token count that only looks at the clock once the bucket is empty.
+  // The LOG_YAML_SAMPLE and LOG_YAML_RATE macros keep one per call site,
+  // shared by every thread that reaches it: with LOG_YAML_THREADS the
+  // counters are atomic and the token bucket is locked.
+  class Sampler
+  {
+#ifdef LOG_YAML_THREADS
+    typedef std::atomic<unsigned long> counter;
+#else
+    typedef unsigned long counter;
+#endif
+    const char* site_name;
+    SampleMode mode;
+    double n;
+    double burst;
+    counter count;
+    counter held_back;
+    double tokens;
+    double refilled;
+#ifdef LOG_YAML_THREADS
+    std::mutex bucket_lock;
+#endif
+    Sampler* later;
+
+    Sampler(const Sampler&);
+    Sampler& operator=(const Sampler&);
+
+    bool refill()
+    {
+      double t = monotonic_now(true);
+      tokens = std::min(burst, tokens + (t - refilled) * n);
+      refilled = t;
+      return tokens >= 1;
+    }
+
+  public:
+    // site names the call site in report_suppressed() and must outlive
+    // the Sampler; a string literal is the usual choice
+    Sampler(const char* site, SampleMode mode, double n, double burst = 1)
+      : site_name (site),
+        mode (mode),
+        n (n < 1 && mode != SAMPLE_RATE ? 1 : n),
+        burst (burst < 1 ? 1 : burst),
+        count (0),
+        held_back (0),
+        tokens (burst < 1 ? 1 : burst),
+        refilled (mode == SAMPLE_RATE ? monotonic_now(true) : 0),
+        later (0)
+    {
+#ifdef LOG_YAML_THREADS
+      std::lock_guard<std::mutex> lock(sampler_list_lock());
+#endif
+      Sampler** p = &sampler_list();
+      while(*p)
+        p = &(*p)->later;
+      *p = this;
+    }
+
+    ~Sampler()
+    {
+#ifdef LOG_YAML_THREADS
+      std::lock_guard<std::mutex> lock(sampler_list_lock());
+#endif
+      for(Sampler** p = &sampler_list(); *p; p = &(*p)->later)
+        if(*p == this) {
+          *p = later;
+          break;
+        }
+    }
+
+    // true if this event should be logged. The counting modes decide from
+    // the event's number alone, so threads only share one increment.
+    inline bool sample()
+    {
+      bool take;
+      if(mode == SAMPLE_EVERY_N) {
+        take = count++ % (unsigned long)n == 0;
+      }
+      else if(mode == SAMPLE_BACKOFF) {
+        // the first n, then the events numbered n times a power of two
+        unsigned long k = count++ + 1;
+        unsigned long q = k / (unsigned long)n;
+        take = k <= (unsigned long)n ||
+               (k % (unsigned long)n == 0 && (q & (q - 1)) == 0);
+      }
+      else {
+#ifdef LOG_YAML_THREADS
+        std::lock_guard<std::mutex> lock(bucket_lock);
+#endif
+        take = tokens >= 1 || refill();
+        if(take)
+          tokens -= 1;
+      }
+      if(!take)
+        held_back++;
+      return take;
+    }
+
+    const char* site() const { return site_name; }
+
+    // Events held back since the last reset_suppressed()
+    unsigned long suppressed() const { return held_back; }
+    void reset_suppressed() { held_back = 0; }
+
+    // suppressed(), then reset_suppressed(), without losing events held
+    // back by other threads in between
+    unsigned long take_suppressed()
+    {
+#ifdef LOG_YAML_THREADS
+      return held_back.exchange(0);
+#else
+      unsigned long held = held_back;
+      held_back = 0;
+      return held;
+#endif
+    }
+
+    Sampler* following() const { return later; }
+  };
+
+  // Logs, under keystr, how many events each call site has held back since
+  // the last report, and starts counting again. Sites that held nothing
+  // back are left out, and with none at all nothing is logged. Safe to call
+  // while other threads are sampling; their later events go in the next
+  // report.
+  inline void report_suppressed(Log& log, const string& keystr = "suppressed")
+  {
+#ifdef LOG_YAML_THREADS
+    std::lock_guard<std::mutex> lock(sampler_list_lock());
+#endif
+    bool opened = false;
+    for(Sampler* s = sampler_list(); s; s = s->following()) {
+      unsigned long held = s->take_suppressed();
+      if(!held)
+        continue;
+      if(!opened)
+        log.open(keystr);
+      opened = true;
+      log.emit(s->site(), held);
+    }
+    if(opened)
+      log.close();
+  }
+
+#ifdef LOG_YAML_THREADS
+  // A Log for many threads. Rather than taking a lock per line, each thread
+  // fills a block of its own and commit() publishes the whole block under
+  // one top-level key while holding the lock once, so blocks never
+  // interleave and the output stays valid YAML.
+  //
+  //   Log::SharedLog shared(log);
+  //   // in each thread
+  //   Log::Log block = shared.block();
+  //   block.log("x", 1);
+  //   shared.commit("worker", block);
+  class SharedLog
+  {
+    Log& log;
+    std::mutex m;
+
+    SharedLog(const SharedLog&);
+    SharedLog& operator=(const SharedLog&);
+
+  public:
+    explicit SharedLog(Log& log) : log(log) {}
+
+    inline Log block()
+    {
+      std::lock_guard<std::mutex> lock(m);
+      return log.block();
+    }
+
+    inline void commit(const string& keystr, Log& block)
+    {
+      std::lock_guard<std::mutex> lock(m);
+      log.splice(keystr, block);
+    }
+
+    // A single line straight into the shared log, under the lock
+    template<typename T>
+    inline void log_line(const string& keystr, const T& t)
+    {
+      std::lock_guard<std::mutex> lock(m);
+      log.emit(keystr, t);
+    }
+
+    inline void flush()
+    {
+      std::lock_guard<std::mutex> lock(m);
+      log.flush();
+    }
+  };
+#endif // LOG_YAML_THREADS
+
+  // Binary capture: Recorder takes the same calls as Log but, instead of
+  // formatting, appends compact binary records to a sink. render() replays
+  // them through a Log later, byte for byte what the Log would have said.
+  // StreamSink, FileSink and UringSink take records, and so does an
+  // AsyncSink in front of one of them; see Sink::binary_safe().
+  //
+  // Records are native-endian and sized for the machine that wrote them:
+  //   "LYB1" u32 len top_key           stream header
+  //   'k' u32 id u32 len bytes         defines a key id (0 is anonymous)
+  //   'o' u32 key  /  'c'              open / close
+  //   tag u32 key value                scalar: raw bytes, or u32 len bytes
+  //   'v' u32 key tag u32 count values container of scalars
+  // where tag is one of i j l m s t f d (int, unsigned, long, unsigned long,
+  // short, unsigned short, float, double) or z (string).
+  template <typename T> struct record_tag { static const char value = 'z'; };
+  template<> struct record_tag<int> { static const char value = 'i'; };
+  template<> struct record_tag<unsigned> { static const char value = 'j'; };
+  template<> struct record_tag<long> { static const char value = 'l'; };
+  template<> struct record_tag<unsigned long> { static const char value = 'm'; };
+  template<> struct record_tag<short> { static const char value = 's'; };
+  template<> struct record_tag<unsigned short> { static const char value = 't'; };
+  template<> struct record_tag<float> { static const char value = 'f'; };
+  template<> struct record_tag<double> { static const char value = 'd'; };
+
+  class Recorder
+  {
+  private:
+    Sink& sink;
+    bool ok;
+    map<string, uint32_t> key_ids;
+    string rec;
+
+    template<typename T>
+    inline void put(const T& v)
+    {
+      rec.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    inline void put_str(const char* s, size_t n)
+    {
+      put(static_cast<uint32_t>(n));
+      rec.append(s, n);
+    }
+
+    inline void put_string(const string& s) { put_str(s.data(), s.size()); }
+    inline void put_string(const char* s) { put_str(s, strlen(s)); }
+
+    template<typename T>
+    inline void put_elem(const T& v, const true_type&) { put(v); }
+    template<typename T>
+    inline void put_elem(const T& s, const false_type&) { put_string(s); }
+
+    inline uint32_t key_id(const string& keystr)
+    {
+      if(keystr == "")
+        return 0;
+      map<string, uint32_t>::iterator i = key_ids.find(keystr);
+      if(i != key_ids.end())
+        return i->second;
+      uint32_t id = key_ids.size() + 1;
+      key_ids[keystr] = id;
+      rec += 'k';
+      put(id);
+      put_string(keystr);
+      return id;
+    }
+
+    inline void commit()
+    {
+      if(ok)
+        sink.write(rec.data(), rec.size());
+      rec.clear();
+    }
+
+    template <typename V>
+    inline void log_specialize(const string& keystr, const V& t, const false_type&, const true_type&)
+    {
+      typedef typename std::iterator_traits<typename V::const_iterator>::value_type E;
+      uint32_t id = key_id(keystr);
+      rec += 'v';
+      put(id);
+      rec += record_tag<E>::value;
+      put(static_cast<uint32_t>(t.size()));
+      is_arithmetic<E> x;
+      for(typename V::const_iterator i = t.begin(); i != t.end(); i++)
+        put_elem(*i, x);
+      commit();
+    }
+
+    template<typename T>
+    inline void log_specialize(const string& keystr, const T& t, const true_type&, const false_type&)
+    {
+      uint32_t id = key_id(keystr);
+      rec += record_tag<T>::value;
+      put(id);
+      put(t);
+      commit();
+    }
+
+    // string-like
+    template<typename T>
+    inline void log_specialize(const string& keystr, const T& str, const false_type&, const false_type&)
+    {
+      uint32_t id = key_id(keystr);
+      rec += 'z';
+      put(id);
+      put_string(str);
+      commit();
+    }
+
+  public:
+    // sink must be binary_safe(); if it isn't, nothing is recorded
+    Recorder(const string& top_key, Sink& sink)
+      : sink (sink),
+        ok (sink.binary_safe())
+    {
+      rec = "LYB1";
+      put_string(top_key);
+      commit();
+    }
+
+    // false if the sink can't take binary records
+    bool good() const { return ok; }
+
+    template<typename T>
+    inline void log(const string& keystr, const T& t)
+    {
+      is_arithmetic<T> x;
+      is_container<T> y;
+      log_specialize(keystr, t, x, y);
+    }
+
+    template<typename T>
+    inline void log(const T& t)
+    {
+      log(string(""), t);
+    }
+
+    template<typename T>
+    inline void operator ()(const T& t)
+    {
+      log(t);
+    }
+
+    template<typename T>
+    inline void operator ()(const string& keystr, const T& t)
+    {
+      log(keystr, t);
+    }
+
+    inline void open(const string& keystr)
+    {
+      uint32_t id = key_id(keystr);
+      rec += 'o';
+      put(id);
+      commit();
+    }
+
+    inline void close()
+    {
+      rec += 'c';
+      commit();
+    }
+
+    inline void flush()
+    {
+      sink.flush();
+    }
+  };
+
+  // Reads a Recorder stream back and replays it into a Log. A stream cut
+  // short ends at its last complete record, and one that is malformed at
+  // its first bad record.
+  class Replayer
+  {
+  private:
+    const char* p;
+    const char* end;
+    vector<string> keys;
+
+    template<typename T>
+    inline bool get(T& v)
+    {
+      if(size_t(end - p) < sizeof(v))
+        return false;
+      memcpy(&v, p, sizeof(v));
+      p += sizeof(v);
+      return true;
+    }
+
+    inline bool get(string& s)
+    {
+      uint32_t n;
+      if(!get(n) || size_t(end - p) < n)
+        return false;
+      s.assign(p, n);
+      p += n;
+      return true;
+    }
+
+    inline bool get_key(string& k)
+    {
+      uint32_t id;
+      if(!get(id) || id >= keys.size())
+        return false;
+      k = keys[id];
+      return true;
+    }
+
+    template<typename T>
+    inline bool scalar(Log& log)
+    {
+      string k;
+      T v;
+      if(!get_key(k) || !get(v))
+        return false;
+      log.log(k, v);
+      return true;
+    }
+
+    template<typename T>
+    inline bool container(Log& log, const string& k)
+    {
+      uint32_t n;
+      if(!get(n))
+        return false;
+      vector<T> v(n);
+      for(uint32_t i = 0; i < n; i++)
+        if(!get(v[i]))
+          return false;
+      log.log(k, v);
+      return true;
+    }
+
+    inline bool container(Log& log)
+    {
+      string k;
+      char tag;
+      if(!get_key(k) || !get(tag))
+        return false;
+      switch(tag) {
+      case 'i': return container<int>(log, k);
+      case 'j': return container<unsigned>(log, k);
+      case 'l': return container<long>(log, k);
+      case 'm': return container<unsigned long>(log, k);
+      case 's': return container<short>(log, k);
+      case 't': return container<unsigned short>(log, k);
+      case 'f': return container<float>(log, k);
+      case 'd': return container<double>(log, k);
+      case 'z': return container<string>(log, k);
+      }
+      return false;
+    }
+
+    inline bool record(Log& log)
+    {
+      char tag;
+      if(!get(tag))
+        return false;
+      switch(tag) {
+      case 'k': {
+        uint32_t id;
+        string k;
+        // Recorder numbers keys 1, 2, 3 ... as it meets them
+        if(!get(id) || id != keys.size() || !get(k))
+          return false;
+        keys.push_back(k);
+        return true;
+      }
+      case 'o': {
+        string k;
+        if(!get_key(k))
+          return false;
+        log.open(k);
+        return true;
+      }
+      case 'c':
+        log.close();
+        return true;
+      case 'i': return scalar<int>(log);
+      case 'j': return scalar<unsigned>(log);
+      case 'l': return scalar<long>(log);
+      case 'm': return scalar<unsigned long>(log);
+      case 's': return scalar<short>(log);
+      case 't': return scalar<unsigned short>(log);
+      case 'f': return scalar<float>(log);
+      case 'd': return scalar<double>(log);
+      case 'z': return scalar<string>(log);
+      case 'v': return container(log);
+      }
+      return false;
+    }
+
+  public:
+    Replayer(const char* data, size_t n)
+      : p (data),
+        end (data + n),
+        keys (1)
+    {}
+
+    // The top key from the stream header; false if there is no header
+    inline bool top_key(string& k)
+    {
+      if(size_t(end - p) < 4 || string(p, 4) != "LYB1")
+        return false;
+      p += 4;
+      return get(k);
+    }
+
+    inline void replay(Log& log)
+    {
+      while(record(log))
+        ;
+    }
+  };
+
+  // Renders a Recorder stream to the document Log::str() would have returned
+  inline string render(const string& records)
+  {
+    Replayer r(records.data(), records.size());
+    string top_key;
+    if(!r.top_key(top_key))
+      return string("");
+    Log log(top_key, false);
+    r.replay(log);
+    return log.str();
+  }
+
+  // Renders a Recorder stream line by line into sink, terminator included
+  inline void render(const string& records, Sink& sink)
+  {
+    Replayer r(records.data(), records.size());
+    string top_key;
+    if(!r.top_key(top_key))
+      return;
+    Log log(top_key, sink);
+    r.replay(log);
+    log.terminator();
+    log.flush();
+  }
 }
 
+// Logs value under keystr if severity passes both the compile-time minimum
+// and log's threshold. Skipped calls don't evaluate keystr or value; log
+// is evaluated once.
+#define LOG_YAML_AT(log, severity, keystr, value)                       \
+  do {                                                                  \
+    if((severity) >= LOG_YAML_MIN_SEVERITY) {                           \
+      Log::Log& log_yaml_l = (log);                                     \
+      if(log_yaml_l.enabled(severity))                                  \
+        log_yaml_l.emit(keystr, value);                                 \
+    }                                                                   \
+  } while(0)
+
+#define LOG_YAML_SKIP(log, keystr, value) do {} while(0)
+
+#define LOG_YAML_STR2(x) #x
+#define LOG_YAML_STR(x) LOG_YAML_STR2(x)
+#define LOG_YAML_SITE __FILE__ ":" LOG_YAML_STR(__LINE__)
+
+// Logs value under keystr for the events this call site's Sampler lets
+// through; mode and n as for Log::Sampler. Held back events evaluate
+// neither keystr nor value.
+#define LOG_YAML_SAMPLE(log, mode, n, keystr, value)                    \
+  do {                                                                  \
+    static Log::Sampler log_yaml_site(LOG_YAML_SITE, mode, n);          \
+    if(log_yaml_site.sample())                                          \
+      (log).emit(keystr, value);                                        \
+  } while(0)
+
+// At most per_second entries from this call site, in bursts of up to burst
+#define LOG_YAML_RATE(log, per_second, burst, keystr, value)            \
+  do {                                                                  \
+    static Log::Sampler log_yaml_site(LOG_YAML_SITE, Log::SAMPLE_RATE,  \
+                                      per_second, burst);               \
+    if(log_yaml_site.sample())                                          \
+      (log).emit(keystr, value);                                        \
+  } while(0)
+
+#if LOG_YAML_MIN_SEVERITY <= 0
+#define LOG_YAML_TRACE(log, keystr, value) LOG_YAML_AT(log, Log::SEVERITY_TRACE, keystr, value)
+#else
+#define LOG_YAML_TRACE(log, keystr, value) LOG_YAML_SKIP(log, keystr, value)
+#endif
+#if LOG_YAML_MIN_SEVERITY <= 1
+#define LOG_YAML_DEBUG(log, keystr, value) LOG_YAML_AT(log, Log::SEVERITY_DEBUG, keystr, value)
+#else
+#define LOG_YAML_DEBUG(log, keystr, value) LOG_YAML_SKIP(log, keystr, value)
+#endif
+#if LOG_YAML_MIN_SEVERITY <= 2
+#define LOG_YAML_INFO(log, keystr, value) LOG_YAML_AT(log, Log::SEVERITY_INFO, keystr, value)
+#else
+#define LOG_YAML_INFO(log, keystr, value) LOG_YAML_SKIP(log, keystr, value)
+#endif
+#if LOG_YAML_MIN_SEVERITY <= 3
+#define LOG_YAML_WARN(log, keystr, value) LOG_YAML_AT(log, Log::SEVERITY_WARN, keystr, value)
+#else
+#define LOG_YAML_WARN(log, keystr, value) LOG_YAML_SKIP(log, keystr, value)
+#endif
+#if LOG_YAML_MIN_SEVERITY <= 4
+#define LOG_YAML_ERROR(log, keystr, value) LOG_YAML_AT(log, Log::SEVERITY_ERROR, keystr, value)
+#else
+#define LOG_YAML_ERROR(log, keystr, value) LOG_YAML_SKIP(log, keystr, value)
+#endif
+
 #endif // evil defines check
 #endif // _LOG_YAML_H
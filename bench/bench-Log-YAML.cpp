@@ -0,0 +1,392 @@
+// Micro-benchmarks for Log-YAML.hpp
+//
+//   ./bench.sh              run everything
+//   ./a.out integers        run the benchmarks whose name contains "integers"
+
+#include "../Log-YAML.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Discards everything, so only formatting is measured
+struct NullSink : public Log::Sink
+{
+  size_t bytes;
+  NullSink() : bytes(0) {}
+  void write(const char*, size_t n) { bytes += n; }
+};
+
+// The original escaper: one switch and one back_insert per byte
+static void per_char_escape(string& out, const string& in)
+{
+  back_insert_iterator<string> oi(out);
+  for(string::const_iterator i = in.begin(); i != in.end(); i++) {
+    char c = *i;
+    if(Log::needs_escape(c))
+      Log::escape_char(out, c);
+    else
+      *oi++ = c;
+  }
+}
+
+// Keeps the optimizer from dropping results
+static volatile size_t sink_hole;
+
+template<typename F>
+static void run(const char* name, size_t n, F f)
+{
+  chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+  f(n);
+  chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+  double ns = chrono::duration<double, nano>(t1 - t0).count();
+  printf("%-40s %10.1f ns/op\n", name, ns / n);
+}
+
+static bool selected(int argc, char** argv, const char* name)
+{
+  if(argc < 2)
+    return true;
+  for(int i = 1; i < argc; i++)
+    if(strstr(name, argv[i]))
+      return true;
+  return false;
+}
+
+// Buffered stdio, the usual baseline for file logging
+struct StdioSink : public Log::Sink
+{
+  FILE* f;
+  StdioSink(const char* path) : f(fopen(path, "a")) { setvbuf(f, 0, _IOFBF, 1 << 20); }
+  ~StdioSink() { fclose(f); }
+  void write(const char* data, size_t n) { fwrite(data, 1, n, f); }
+  void flush() { fflush(f); }
+};
+
+static const char* sink_path = "bench-Log-YAML.sink.yaml";
+
+// Logs ~100 byte lines at mb_per_s (0: as fast as possible) for a while
+// and reports the time spent inside log() per line, the worst single
+// call, and the rate the file actually got including closing it
+template<typename S>
+static void sink_at_rate(const char* name, double mb_per_s)
+{
+  typedef chrono::steady_clock clock;
+  const double seconds = 0.5;
+  const string payload(80, 'x');
+  remove(sink_path);
+  size_t lines = 0;
+  double busy = 0, worst = 0;
+  clock::time_point t0 = clock::now();
+  {
+    S sink(sink_path);
+    Log::Log log("log", sink);
+    size_t bytes = 0;
+    for(;;) {
+      double elapsed = chrono::duration<double>(clock::now() - t0).count();
+      if(elapsed >= seconds)
+        break;
+      if(mb_per_s > 0 && bytes > elapsed * mb_per_s * 1e6)
+        continue;
+      clock::time_point a = clock::now();
+      log.log(payload);
+      double ns = chrono::duration<double, nano>(clock::now() - a).count();
+      busy += ns;
+      worst = std::max(worst, ns);
+      bytes += payload.size() + 20;
+      lines++;
+    }
+  }
+  double total = chrono::duration<double>(clock::now() - t0).count();
+  FILE* f = fopen(sink_path, "r");
+  fseek(f, 0, SEEK_END);
+  double mb = ftell(f) / 1e6;
+  fclose(f);
+  remove(sink_path);
+  printf("%-40s %10.1f ns/op %8.1f us max %8.1f MB/s\n",
+         name, busy / lines, worst / 1000, mb / total);
+}
+
+#define BENCH(name, n, ...)                       \
+  if(selected(argc, argv, name))                  \
+    run(name, n, [&](size_t count) { __VA_ARGS__; })
+
+int main(int argc, char** argv)
+{
+  BENCH("integers/ostringstream", 2000000, {
+      for(size_t i = 0; i < count; i++) {
+        ostringstream o;
+        o << (long)(i * 2654435761u);
+        sink_hole += o.str().size();
+      }
+    });
+
+  BENCH("integers/format_integer", 2000000, {
+      char buf[Log::INT_BUFSIZE];
+      for(size_t i = 0; i < count; i++)
+        sink_hole += Log::format_integer(buf, (long)(i * 2654435761u)) - buf;
+    });
+
+  BENCH("doubles/ostringstream", 1000000, {
+      for(size_t i = 0; i < count; i++) {
+        ostringstream o;
+        o << i * 1.000123;
+        sink_hole += o.str().size();
+      }
+    });
+
+  BENCH("doubles/format_double", 1000000, {
+      char buf[Log::FLOAT_BUFSIZE];
+      for(size_t i = 0; i < count; i++)
+        sink_hole += Log::format_double(buf, i * 1.000123) - buf;
+    });
+
+  BENCH("integers/emit", 1000000, {
+      NullSink null;
+      Log::Log log("log", null);
+      for(size_t i = 0; i < count; i++)
+        log.emit((int)i);
+      sink_hole += null.bytes;
+    });
+
+  // Per line retained, str() included
+  BENCH("retained/str of 1M lines", 1000000, {
+      Log::Log log("log", false);
+      for(size_t i = 0; i < count; i++)
+        log.emit((int)i);
+      sink_hole += log.str().size();
+    });
+
+  string command_line;
+  for(int i = 0; i < 40; i++)
+    command_line += "--input=data-run-part-00042.bin --threads 16 ";
+  command_line += "\"quoted\"\n";
+
+  BENCH("escape/per-char", 200000, {
+      for(size_t i = 0; i < count; i++) {
+        string out;
+        per_char_escape(out, command_line);
+        sink_hole += out.size();
+      }
+    });
+
+  BENCH("escape/escape_append", 200000, {
+      for(size_t i = 0; i < count; i++) {
+        string out;
+        Log::escape_append(out, command_line.data(), command_line.size());
+        sink_hole += out.size();
+      }
+    });
+
+  BENCH("integers/log", 1000000, {
+      NullSink null;
+      Log::Log log("log", null);
+      for(size_t i = 0; i < count; i++)
+        log.log((int)i);
+      sink_hole += null.bytes;
+    });
+
+  BENCH("keys/repeated x2000", 2000, {
+      NullSink null;
+      Log::Log log("log", null);
+      for(size_t i = 0; i < count; i++)
+        log.log("x", 1);
+      sink_hole += null.bytes;
+    });
+
+  BENCH("keys/distinct", 200000, {
+      NullSink null;
+      Log::Log log("log", null);
+      char key[32];
+      for(size_t i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "key-%zu", i);
+        log.log(key, 1);
+      }
+      sink_hole += null.bytes;
+    });
+
+  // A call below the runtime threshold should cost one compare
+  BENCH("severity/below threshold", 50000000, {
+      NullSink null;
+      Log::Log log("log", null);
+      log.set_threshold(Log::SEVERITY_WARN);
+      for(size_t i = 0; i < count; i++)
+        LOG_YAML_DEBUG(log, "i", i);
+      sink_hole += null.bytes;
+    });
+
+  BENCH("severity/enabled", 500000, {
+      NullSink null;
+      Log::Log log("log", null);
+      for(size_t i = 0; i < count; i++)
+        LOG_YAML_INFO(log, "", i);
+      sink_hole += null.bytes;
+    });
+
+  // Nearly every call is held back, so this is the cost of a suppressed one
+  BENCH("sampling/1 in 1M", 50000000, {
+      NullSink null;
+      Log::Log log("log", null);
+      for(size_t i = 0; i < count; i++)
+        LOG_YAML_SAMPLE(log, Log::SAMPLE_EVERY_N, 1000000, "", i);
+      sink_hole += null.bytes;
+    });
+
+  BENCH("sampling/backoff", 50000000, {
+      NullSink null;
+      Log::Log log("log", null);
+      for(size_t i = 0; i < count; i++)
+        LOG_YAML_SAMPLE(log, Log::SAMPLE_BACKOFF, 10, "", i);
+      sink_hole += null.bytes;
+    });
+
+  BENCH("sampling/rate 100/s", 10000000, {
+      NullSink null;
+      Log::Log log("log", null);
+      for(size_t i = 0; i < count; i++)
+        LOG_YAML_RATE(log, 100, 10, "", i);
+      sink_hole += null.bytes;
+    });
+
+  // Instead of a line per sample under a growing x, x', x'' ...
+  BENCH("stats/aggregate", 10000000, {
+      NullSink null;
+      Log::Log log("log", null);
+      Log::Stats& s = log.aggregate("x");
+      for(size_t i = 0; i < count; i++)
+        s.add(double(i % 1000));
+      log.terminator();
+      sink_hole += null.bytes;
+    });
+
+  vector<double> doubles(1000000);
+  for(size_t i = 0; i < doubles.size(); i++)
+    doubles[i] = i * 0.001;
+
+  BENCH("containers/vector<double> 1M", 5, {
+      NullSink null;
+      Log::Log log("log", null);
+      for(size_t i = 0; i < count; i++)
+        log.log(doubles);
+      sink_hole += null.bytes;
+    });
+
+  // Same output spread over lines of 1000; only one line is held at a time
+  BENCH("containers/vector<double> 1M chunked", 5, {
+      NullSink null;
+      Log::Log log("log", null);
+      log.set_chunk_size(1000);
+      for(size_t i = 0; i < count; i++)
+        log.emit(doubles);
+      sink_hole += null.bytes;
+    });
+
+  // Parallel formatting: the same 1M doubles split over N threads, up to
+  // the core count that set_format_threads() stops at
+  unsigned format_max = std::max(1u, thread::hardware_concurrency());
+  for(unsigned threads = 1; threads <= format_max; threads *= 2) {
+    char name[64];
+    snprintf(name, sizeof(name), "containers/vector<double> 1M x%u", threads);
+    BENCH(name, 5, {
+        NullSink null;
+        Log::Log log("log", null);
+        log.set_format_threads(threads);
+        for(size_t i = 0; i < count; i++)
+          log.emit(doubles);
+        sink_hole += null.bytes;
+      });
+  }
+
+  // Per-line cost should not grow with depth
+  const unsigned depths[] = { 1, 8, 32, 128 };
+  for(size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+    char name[64];
+    snprintf(name, sizeof(name), "indent/depth %u", depths[d]);
+    BENCH(name, 500000, {
+        NullSink null;
+        Log::Log log("log", null);
+        for(unsigned i = 1; i < depths[d]; i++)
+          log.open("sub");
+        for(size_t i = 0; i < count; i++)
+          log.log(1);
+        sink_hole += null.bytes;
+      });
+  }
+
+  // Threads each logging 10 values at a time: one global mutex taken per
+  // line against SharedLog's one lock per block of 10
+  unsigned max_threads = std::max(4u, thread::hardware_concurrency());
+  for(unsigned threads = 1; threads <= max_threads; threads *= 2) {
+    char name[64];
+    snprintf(name, sizeof(name), "threads/mutex per line x%u", threads);
+    BENCH(name, 200000, {
+        NullSink null;
+        Log::Log log("log", null);
+        mutex m;
+        vector<thread> pool;
+        for(unsigned t = 0; t < threads; t++)
+          pool.push_back(thread([&] {
+                for(size_t i = 0; i < count / threads; i++) {
+                  lock_guard<mutex> lock(m);
+                  log.emit(int(i % 10));
+                }
+              }));
+        for(unsigned t = 0; t < threads; t++)
+          pool[t].join();
+        sink_hole += null.bytes;
+      });
+
+    snprintf(name, sizeof(name), "threads/SharedLog blocks x%u", threads);
+    BENCH(name, 200000, {
+        NullSink null;
+        Log::Log log("log", null);
+        Log::SharedLog shared(log);
+        vector<thread> pool;
+        for(unsigned t = 0; t < threads; t++)
+          pool.push_back(thread([&] {
+                Log::Log block = shared.block();
+                for(size_t i = 0; i < count / threads / 10; i++) {
+                  for(int j = 0; j < 10; j++)
+                    block.emit(j);
+                  shared.commit("", block);
+                }
+              }));
+        for(unsigned t = 0; t < threads; t++)
+          pool[t].join();
+        sink_hole += null.bytes;
+      });
+  }
+
+  // File sinks end to end at a few log rates
+  const double rates[] = { 1, 10, 100, 0 };
+  for(size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    char rate[32];
+    if(rates[r] > 0)
+      snprintf(rate, sizeof(rate), "%g MB/s", rates[r]);
+    else
+      snprintf(rate, sizeof(rate), "unthrottled");
+    char name[64];
+    snprintf(name, sizeof(name), "sinks/stdio %s", rate);
+    if(selected(argc, argv, name))
+      sink_at_rate<StdioSink>(name, rates[r]);
+    snprintf(name, sizeof(name), "sinks/FileSink %s", rate);
+    if(selected(argc, argv, name))
+      sink_at_rate<Log::FileSink>(name, rates[r]);
+    snprintf(name, sizeof(name), "sinks/MmapSink %s", rate);
+    if(selected(argc, argv, name))
+      sink_at_rate<Log::MmapSink>(name, rates[r]);
+    snprintf(name, sizeof(name), "sinks/UringSink %s", rate);
+    if(selected(argc, argv, name))
+      sink_at_rate<Log::UringSink>(name, rates[r]);
+  }
+
+  return 0;
+}
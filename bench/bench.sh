@@ -0,0 +1,4 @@
+#!/bin/bash
+
+echo benchmarking ...
+c++ -O2 -Wall -pthread bench-Log-YAML.cpp && ./a.out "$@"
@@ -2,6 +2,8 @@
 // TODO logf, const versions, stderr, generic containers
 // float INF, NAN
 
+// TRACE is compiled out; see the Severity test
+#define LOG_YAML_MIN_SEVERITY 1
 #include "../Log-YAML.hpp"
 
 #define CATCH_CONFIG_MAIN
@@ -9,6 +11,11 @@
 
 // #include <cstdint>
 #include <stdint.h>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <memory>
 #include <iostream>
 #include <vector>
 #include <boost/assign.hpp>
@@ -144,6 +151,34 @@ TEST_CASE("vector", "[Log]")
             string("  \"0\": [\"a\", \"b\"]\n"));
   }
 
+  SECTION("vector string escaped") {
+    vector<string> v;
+    v += string("\"a\""), string("b\n");
+    REQUIRE(log.log(v) ==
+            string("  \"0\": [\"\\\"a\\\"\", \"b\\n\"]\n"));
+  }
+
+  SECTION("vector long long") {
+    vector<long long> v;
+    v += 5, 300;
+    REQUIRE(log.log(v) ==
+            string("  \"0\": [5, 300]\n"));
+  }
+
+  SECTION("vector bool") {
+    vector<bool> v;
+    v += true, false;
+    REQUIRE(log.log(v) ==
+            string("  \"0\": [1, 0]\n"));
+  }
+
+  SECTION("vector char") {
+    vector<char> v;
+    v += 'a', 'b';
+    REQUIRE(log.log(v) ==
+            string("  \"0\": [a, b]\n"));
+  }
+
 }
 
 TEST_CASE("Escape", "[Log]")
@@ -280,3 +315,1437 @@ TEST_CASE("const", "[Log]") {
   }
 #endif
 }
+
+TEST_CASE("Retention", "[Log]")
+{
+  ostringstream out;
+  Log::StreamSink sink(out);
+
+  SECTION("none") {
+    Log::Log log("log", sink);
+    log.log(1);
+    log.log("a", "b");
+    REQUIRE(out.str() ==
+            string("---\n\"log\":\n  \"0\": 1\n  \"a\": \"b\"\n"));
+    REQUIRE(log.str() == string(""));
+  }
+
+  SECTION("all") {
+    Log::Log log("log", sink, Log::RETAIN_ALL);
+    log.log(1);
+    REQUIRE(log.str() ==
+            string("---\n\"log\":\n  \"0\": 1\n...\n"));
+  }
+
+  SECTION("tail") {
+    Log::Log log("log", sink, Log::RETAIN_TAIL, 20);
+    log.log(1);
+    log.log(2);
+    log.log(3);
+    REQUIRE(log.str() ==
+            string("---\n\"log\":\n  \"1\": 2\n  \"2\": 3\n...\n"));
+  }
+}
+
+static string slurp(const string& path)
+{
+  ifstream f(path.c_str());
+  ostringstream o;
+  o << f.rdbuf();
+  return o.str();
+}
+
+TEST_CASE("FileSink", "[Log]")
+{
+  string path("test-Log-YAML.filesink.yaml");
+  remove(path.c_str());
+
+  SECTION("buffered until flush") {
+    {
+      Log::FileSink sink(path);
+      Log::Log log("log", sink);
+      log.log(1);
+      REQUIRE(slurp(path) == string(""));
+      log.flush();
+      REQUIRE(slurp(path) == string("---\n\"log\":\n  \"0\": 1\n"));
+      log.log(2);
+    }
+    REQUIRE(slurp(path) == string("---\n\"log\":\n  \"0\": 1\n  \"1\": 2\n"));
+  }
+
+  SECTION("flush on top-level key") {
+    Log::FileSink sink(path);
+    sink.flush_on_top_level();
+    Log::Log log("log", sink);
+    log.open("a");
+    log.log(1);
+    REQUIRE(slurp(path) == string("---\n\"log\":\n"));
+    log.close();
+    log.log(2);
+    REQUIRE(slurp(path) == string("---\n\"log\":\n  \"a\":\n    \"0\": 1\n"));
+  }
+
+  SECTION("flush every n bytes") {
+    Log::FileSink sink(path);
+    sink.flush_every(8);
+    Log::Log log("log", sink);
+    REQUIRE(slurp(path) == string("---\n\"log\":\n"));
+  }
+
+  SECTION("small buffer only flushes whole lines") {
+    Log::FileSink sink(path, 12);
+    Log::Log log("log", sink);
+    log.log("abc", 1);
+    REQUIRE(slurp(path) == string("---\n\"log\":\n"));
+  }
+
+  SECTION("flush interval checked on write") {
+    Log::FileSink sink(path);
+    sink.flush_interval(0.05);
+    Log::Log log("log", sink);
+    log.log(1);
+    REQUIRE(slurp(path) == string(""));
+    usleep(60000);
+    log.log(2);
+    REQUIRE(slurp(path) == string("---\n\"log\":\n  \"0\": 1\n  \"1\": 2\n"));
+  }
+
+#ifdef LOG_YAML_THREADS
+  SECTION("flush interval while idle behind an AsyncSink") {
+    Log::FileSink file(path);
+    Log::AsyncSink sink(file, 4096, Log::BLOCK_WHEN_FULL, 0.05);
+    Log::Log log("log", sink);
+    log.log(1);
+    string expect("---\n\"log\":\n  \"0\": 1\n");
+    for(int i = 0; i < 200 && slurp(path) != expect; i++)
+      usleep(10000);
+    REQUIRE(slurp(path) == expect);
+  }
+#endif
+
+  remove(path.c_str());
+}
+
+TEST_CASE("MmapSink", "[Log]")
+{
+  string path("test-Log-YAML.mmapsink.yaml");
+  remove(path.c_str());
+
+  SECTION("trimmed and terminated on close") {
+    {
+      Log::MmapSink sink(path);
+      REQUIRE(sink.good());
+      Log::Log log("log", sink);
+      log.log(1);
+    }
+    REQUIRE(slurp(path) == string("---\n\"log\":\n  \"0\": 1\n...\n"));
+  }
+
+  SECTION("no second terminator") {
+    {
+      Log::MmapSink sink(path);
+      Log::Log log("log", sink);
+      log.terminator();
+    }
+    REQUIRE(slurp(path) == string("---\n\"log\":\n...\n"));
+  }
+
+  SECTION("grows past many extents") {
+    ostringstream expected;
+    expected << "---\n\"log\":\n";
+    {
+      Log::MmapSink sink(path, 4096);
+      Log::Log log("log", sink);
+      for(int i = 0; i < 2000; i++) {
+        log.log(i);
+        expected << "  \"" << i << "\": " << i << "\n";
+      }
+      REQUIRE(sink.good());
+    }
+    expected << "...\n";
+    REQUIRE(slurp(path) == expected.str());
+  }
+
+  SECTION("appends to an existing file") {
+    {
+      Log::MmapSink sink(path);
+      Log::Log log("a", sink);
+    }
+    {
+      Log::MmapSink sink(path);
+      Log::Log log("b", sink);
+    }
+    REQUIRE(slurp(path) == string("---\n\"a\":\n...\n---\n\"b\":\n...\n"));
+  }
+
+  remove(path.c_str());
+}
+
+TEST_CASE("UringSink", "[Log]")
+{
+  string path("test-Log-YAML.uringsink.yaml");
+  remove(path.c_str());
+  ostringstream expected;
+  expected << "---\n\"log\":\n";
+
+  SECTION("in order across buffer swaps") {
+    {
+      Log::UringSink sink(path, 256);
+      Log::Log log("log", sink);
+      for(int i = 0; i < 1000; i++) {
+        log.log(i);
+        expected << "  \"" << i << "\": " << i << "\n";
+      }
+      log.log("long", string(600, 'x'));
+      expected << "  \"long\": \"" << string(600, 'x') << "\"\n";
+      REQUIRE(sink.good());
+    }
+    REQUIRE(slurp(path) == expected.str());
+  }
+
+  SECTION("flush reaches the file") {
+    Log::UringSink sink(path);
+    Log::Log log("log", sink);
+    log.log(1);
+    log.flush();
+    expected << "  \"0\": 1\n";
+    REQUIRE(slurp(path) == expected.str());
+  }
+
+  remove(path.c_str());
+}
+
+TEST_CASE("RotatingSink", "[Log]")
+{
+  string path("test-Log-YAML.rotating.yaml");
+  string first = path + ".1", second = path + ".2", third = path + ".3";
+  remove(path.c_str());
+  remove(first.c_str());
+  remove(second.c_str());
+  remove(third.c_str());
+
+  SECTION("each file is a document") {
+    {
+      Log::RotatingSink sink(path, 25);
+      Log::Log log("log", sink);
+      log.open("a");
+      log.log("x", 1);
+      log.log("y", 2);
+      log.open("b");
+      log.log("z", 3);
+    }
+    REQUIRE(slurp(first) ==
+            "---\n\"log\":\n  \"a\":\n    \"x\": 1\n...\n");
+    REQUIRE(slurp(second) ==
+            "---\n\"log\":\n  \"a\":\n    \"y\": 2\n...\n");
+    REQUIRE(slurp(third) ==
+            "---\n\"log\":\n  \"a\":\n    \"b\":\n...\n");
+    REQUIRE(slurp(path) ==
+            "---\n\"log\":\n  \"a\":\n    \"b\":\n      \"z\": 3\n");
+  }
+
+#ifdef LOG_YAML_THREADS
+  SECTION("behind an AsyncSink") {
+    {
+      Log::RotatingSink files(path, 25);
+      Log::AsyncSink sink(files);
+      Log::Log log("log", sink);
+      log.open("a");
+      log.log("x", 1);
+      log.log("y", 2);
+    }
+    REQUIRE(slurp(first) ==
+            "---\n\"log\":\n  \"a\":\n    \"x\": 1\n...\n");
+    REQUIRE(slurp(path) ==
+            "---\n\"log\":\n  \"a\":\n    \"y\": 2\n");
+  }
+#endif
+
+  SECTION("a new document needs no extra header") {
+    {
+      Log::RotatingSink sink(path, 10);
+      Log::Log log("log", sink);
+      log.terminator();
+      log.clear();
+    }
+    REQUIRE(slurp(first) == "---\n\"log\":\n...\n");
+    REQUIRE(slurp(path) == "---\n\"log\":\n");
+  }
+
+  SECTION("by age") {
+    {
+      Log::RotatingSink sink(path, 0, 1e-9);
+      Log::Log log("log", sink);
+      log.log("x", 1);
+    }
+    REQUIRE(slurp(second) == "---\n\"log\":\n...\n");
+    REQUIRE(slurp(path) == "---\n\"log\":\n  \"x\": 1\n");
+  }
+
+  SECTION("lines split across writes") {
+    {
+      Log::RotatingSink sink(path, 15);
+      sink.write("---\n\"lo", 7);
+      sink.write("g\":\n  \"a\"", 9);
+      sink.write(": 1\n  \"b\": 2\n  \"c", 17);
+    }
+    REQUIRE(slurp(first) == "---\n\"log\":\n  \"a\": 1\n...\n");
+    REQUIRE(slurp(path) == "---\n\"log\":\n  \"b\": 2\n  \"c");
+  }
+
+  remove(path.c_str());
+  remove(first.c_str());
+  remove(second.c_str());
+  remove(third.c_str());
+}
+
+#ifdef LOG_YAML_THREADS
+// Holds the writer thread inside write() until opened
+struct GateSink : public Log::Sink
+{
+  ostringstream out;
+  std::atomic<bool> open;
+  std::atomic<int> entered;
+  GateSink() : open(false), entered(0) {}
+  void write(const char* data, size_t n) {
+    entered++;
+    while(!open)
+      std::this_thread::yield();
+    out.write(data, n);
+  }
+};
+
+TEST_CASE("AsyncSink", "[Log]")
+{
+  SECTION("flush delivers everything in order") {
+    ostringstream out;
+    Log::StreamSink target(out);
+    Log::AsyncSink sink(target, 4);
+    Log::Log log("log", sink);
+    for(int i = 0; i < 100; i++)
+      log.log(i);
+    log.flush();
+    Log::Log expect("log", false);
+    for(int i = 0; i < 100; i++)
+      expect.log(i);
+    REQUIRE(out.str() + "...\n" == expect.str());
+  }
+
+  SECTION("drop newest when full") {
+    GateSink target;
+    Log::AsyncSink sink(target, 2, Log::DROP_NEWEST);
+    sink.write("a\n", 2);
+    while(target.entered == 0)
+      std::this_thread::yield();
+    sink.write("b\n", 2);
+    sink.write("c\n", 2);
+    sink.write("d\n", 2);
+    REQUIRE(sink.dropped() == 1);
+    target.open = true;
+    sink.flush();
+    REQUIRE(target.out.str() == "a\nb\nc\n");
+  }
+
+  SECTION("drop oldest when full") {
+    GateSink target;
+    Log::AsyncSink sink(target, 2, Log::DROP_OLDEST);
+    sink.write("a\n", 2);
+    while(target.entered == 0)
+      std::this_thread::yield();
+    sink.write("b\n", 2);
+    sink.write("c\n", 2);
+    sink.write("d\n", 2);
+    REQUIRE(sink.dropped() == 1);
+    target.open = true;
+    sink.flush();
+    REQUIRE(target.out.str() == "a\nc\nd\n");
+  }
+
+  SECTION("a dropped marker is not a dropped line") {
+    GateSink target;
+    Log::AsyncSink sink(target, 2, Log::DROP_OLDEST);
+    sink.write("a\n", 2);
+    while(target.entered == 0)
+      std::this_thread::yield();
+    sink.top_level();
+    sink.write("b\n", 2);
+    sink.write("c\n", 2);
+    REQUIRE(sink.dropped() == 0);
+    sink.write("d\n", 2);
+    REQUIRE(sink.dropped() == 1);
+    target.open = true;
+    sink.flush();
+    REQUIRE(target.out.str() == "a\nc\nd\n");
+  }
+}
+#endif
+
+TEST_CASE("Recorder", "[Log]")
+{
+  ostringstream bin;
+  Log::StreamSink sink(bin);
+  Log::Recorder rec("log", sink);
+  Log::Log log("log", false);
+
+  vector<int> vi;
+  vi += 1, 2, 3;
+  list<double> ld;
+  ld += 1.5, 2.25;
+  vector<char*> vc;
+  vc += (char*)"a", (char*)"b";
+
+#define BOTH(call) do { rec.call; log.call; } while(0)
+  BOTH(log(9));
+  BOTH(log(11e-3));
+  BOTH(log("doh"));
+  BOTH(log("x", 3.0));
+  BOTH(log("x", 1));
+  BOTH(log("x", string("d\"oh")));
+  BOTH(open("sub"));
+  BOTH(log("x", (unsigned short)7));
+  BOTH(log("x", -5L));
+  BOTH(log("x", 2.5f));
+  BOTH(close());
+  BOTH(close());
+  BOTH(log(vi));
+  BOTH(log("l", ld));
+  BOTH(log(vc));
+#undef BOTH
+
+  SECTION("render") {
+    REQUIRE(Log::render(bin.str()) == log.str());
+  }
+
+  SECTION("render to sink") {
+    ostringstream out;
+    Log::StreamSink yaml(out);
+    Log::render(bin.str(), yaml);
+    REQUIRE(out.str() == log.str());
+  }
+
+  SECTION("truncated") {
+    string cut = bin.str().substr(0, bin.str().size() - 1);
+    string full = log.str();
+    string upto_last = full.substr(0, full.rfind("  \"4\":")) + "...\n";
+    REQUIRE(Log::render(cut) == upto_last);
+  }
+
+  SECTION("only onto sinks that take bytes") {
+    REQUIRE(rec.good());
+    string path("test-Log-YAML.recorder.lyb");
+    remove(path.c_str());
+    {
+      Log::RotatingSink files(path, 10);
+      Log::Recorder lines_only("log", files);
+      REQUIRE(!lines_only.good());
+      lines_only.log("x", 1);
+    }
+    REQUIRE(slurp(path) == "");
+    remove(path.c_str());
+  }
+
+  SECTION("key ids out of order") {
+    uint32_t ids[] = { 0, 2, 0xffffffff, 1 };
+    for(int i = 0; i < 4; i++) {
+      string s("LYB1");
+      uint32_t n = 3, len = 1, key = 1;
+      int v = 5;
+      s.append((const char*)&n, 4).append("log");
+      s.append(1, 'k').append((const char*)&ids[i], 4);
+      s.append((const char*)&len, 4).append("a");
+      s.append(1, 'i').append((const char*)&key, 4).append((const char*)&v, 4);
+      REQUIRE(Log::render(s) == (ids[i] == 1
+                                 ? "---\n\"log\":\n  \"a\": 5\n...\n"
+                                 : "---\n\"log\":\n...\n"));
+    }
+  }
+}
+
+template<typename T>
+static string via_stream(T v)
+{
+  ostringstream o;
+  o << v;
+  return o.str();
+}
+
+template<typename T>
+static string via_format(T v)
+{
+  char buf[Log::INT_BUFSIZE];
+  return string(buf, Log::format_integer(buf, v));
+}
+
+TEST_CASE("format_integer", "[Log]")
+{
+  long samples[] = { 0, 1, 9, 10, 11, 99, 100, 101, 999, 1000, 12345, 1000000,
+                     -1, -9, -10, -99, -100, -12345 };
+  for(size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+    REQUIRE(via_format(samples[i]) == via_stream(samples[i]));
+    REQUIRE(via_format((int)samples[i]) == via_stream((int)samples[i]));
+    REQUIRE(via_format((short)samples[i]) == via_stream((short)samples[i]));
+    REQUIRE(via_format((unsigned long)samples[i]) == via_stream((unsigned long)samples[i]));
+    REQUIRE(via_format((unsigned)samples[i]) == via_stream((unsigned)samples[i]));
+    REQUIRE(via_format((unsigned short)samples[i]) == via_stream((unsigned short)samples[i]));
+  }
+  REQUIRE(via_format(numeric_limits<int>::min()) == via_stream(numeric_limits<int>::min()));
+  REQUIRE(via_format(numeric_limits<long>::min()) == via_stream(numeric_limits<long>::min()));
+  REQUIRE(via_format(numeric_limits<long>::max()) == via_stream(numeric_limits<long>::max()));
+  REQUIRE(via_format(numeric_limits<unsigned long>::max()) ==
+          via_stream(numeric_limits<unsigned long>::max()));
+  REQUIRE(via_format(numeric_limits<short>::min()) == via_stream(numeric_limits<short>::min()));
+}
+
+static string fmt(double v, Log::FloatFormat f = Log::FLOAT_SHORTEST)
+{
+  char buf[Log::FLOAT_BUFSIZE];
+  return string(buf, Log::format_double(buf, v, f));
+}
+
+static string fmtf(float v, Log::FloatFormat f = Log::FLOAT_SHORTEST)
+{
+  char buf[Log::FLOAT_BUFSIZE];
+  return string(buf, Log::format_float(buf, v, f));
+}
+
+// The printf search picks the same digits as shortest_digits(), which is
+// to_chars in a C++17 build
+static bool printf_agrees(double v, bool single)
+{
+  char buf[Log::FLOAT_BUFSIZE], a[Log::FLOAT_BUFSIZE], b[Log::FLOAT_BUFSIZE];
+  int ea, eb;
+  Log::shortest_printf(buf, v, single);
+  int na = Log::split_scientific(a, ea, buf);
+  int nb = Log::shortest_digits(b, eb, v, single);
+  return na == nb && ea == eb && memcmp(a, b, na) == 0;
+}
+
+TEST_CASE("Floating point", "[Log]")
+{
+  SECTION("shortest") {
+    REQUIRE(fmt(0.1234567) == "0.1234567");
+    REQUIRE(fmt(1.1) == "1.1");
+    REQUIRE(fmt(11e-3) == "0.011");
+    REQUIRE(fmt(3.0) == "3");
+    REQUIRE(fmt(-2.5) == "-2.5");
+    REQUIRE(fmt(123456789.0) == "123456789");
+    REQUIRE(fmt(1.0 / 3) == "0.3333333333333333");
+    REQUIRE(fmt(0.1 + 0.2) == "0.30000000000000004");
+    REQUIRE(fmt(1e20) == "1e+20");
+    REQUIRE(fmt(1e-5) == "1e-05");
+    REQUIRE(fmt(0.0001) == "0.0001");
+    REQUIRE(fmt(1.5e300) == "1.5e+300");
+    REQUIRE(fmt(5e-324) == "5e-324");
+    REQUIRE(fmt(0.0) == "0");
+    REQUIRE(fmt(numeric_limits<double>::infinity()) == "inf");
+    REQUIRE(fmtf(0.1f) == "0.1");
+    REQUIRE(fmtf(16777216.0f) == "16777216");
+    REQUIRE(fmtf(1.0f / 3) == "0.33333334");
+  }
+
+  SECTION("round trip") {
+    srand(1);
+    for(int i = 0; i < 10000; i++) {
+      double d;
+      unsigned char* b = (unsigned char*)&d;
+      for(size_t j = 0; j < sizeof(d); j++)
+        b[j] = rand();
+      if(d != d || d - d != 0)
+        continue;
+      REQUIRE(strtod(fmt(d).c_str(), 0) == d);
+      float f = (float)(rand() - RAND_MAX / 2) / (rand() + 1);
+      REQUIRE(strtof(fmtf(f).c_str(), 0) == f);
+      if(d != 0)
+        REQUIRE(printf_agrees(d, false));
+      if(f != 0)
+        REQUIRE(printf_agrees(f, true));
+    }
+  }
+
+  SECTION("powers of two") {
+    // the rounded 16 digits 7.120236347223044e-307 don't read back
+    REQUIRE(fmt(ldexp(1.0, -1017)) == "7.120236347223045e-307");
+    for(int e = -1074; e <= 1023; e++) {
+      double d = ldexp(1.0, e);
+      REQUIRE(strtod(fmt(d).c_str(), 0) == d);
+      REQUIRE(printf_agrees(d, false));
+    }
+    for(int e = -149; e <= 127; e++) {
+      float f = ldexpf(1.0f, e);
+      REQUIRE(strtof(fmtf(f).c_str(), 0) == f);
+      REQUIRE(printf_agrees(f, true));
+    }
+  }
+
+  SECTION("legacy") {
+    REQUIRE(fmt(0.1234567, Log::FLOAT_LEGACY) == "0.123457");
+    REQUIRE(fmt(123456789.0, Log::FLOAT_LEGACY) == "1.23457e+08");
+    REQUIRE(fmtf(1.0f / 3, Log::FLOAT_LEGACY) == "0.333333");
+  }
+
+  SECTION("log") {
+    Log::Log log("log", false);
+    REQUIRE(log.log(0.1234567) == "  \"0\": 0.1234567\n");
+    log.set_float_format(Log::FLOAT_LEGACY);
+    REQUIRE(log.log(0.1234567) == "  \"1\": 0.123457\n");
+    vector<double> v;
+    v += 0.1234567, 2;
+    REQUIRE(log.log(v) == "  \"2\": [0.123457, 2]\n");
+  }
+}
+
+// The original per-character escaper, kept as the reference
+static string reference_escape(const string& in)
+{
+  string out;
+  for(size_t i = 0; i < in.size(); i++) {
+    char c = in[i];
+    switch (c) {
+    case '"': out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '/': out += "\\/"; break;
+    case '\b': out += "\\b"; break;
+    case '\f': out += "\\f"; break;
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+        char buf[7];
+        snprintf(buf, sizeof(buf), "\\u%04x", c & 0xff);
+        out.append(buf, 6);
+      } else {
+        out += c;
+      }
+    }
+  }
+  return out;
+}
+
+TEST_CASE("escape_append", "[Log]")
+{
+  srand(2);
+  const char special[] = "\"\\/\b\f\n\r\t\x01\x1f\x20\x7f\x80\xff" "a";
+  for(int i = 0; i < 20000; i++) {
+    size_t n = rand() % 100;
+    int density = rand() % 4;
+    string in;
+    for(size_t j = 0; j < n; j++) {
+      if(density && rand() % (density * 8) == 0)
+        in += special[rand() % (sizeof(special) - 1)];
+      else
+        in += (char)(rand() % 256);
+    }
+    string out("prefix");
+    Log::escape_append(out, in.data(), in.size());
+    REQUIRE(out == "prefix" + reference_escape(in));
+  }
+}
+
+TEST_CASE("Anonymous keys", "[Log]")
+{
+  Log::Log log("log", false);
+
+  SECTION("skip explicit numeric keys") {
+    log.log("1", 1);
+    log.log("2", 1);
+    log.log("4", 1);
+    REQUIRE(log.log(1) == "  \"0\": 1\n");
+    REQUIRE(log.log(1) == "  \"3\": 1\n");
+    REQUIRE(log.log(1) == "  \"5\": 1\n");
+  }
+
+  SECTION("only canonical numbers collide") {
+    log.log("00", 1);
+    log.log("0'", 1);
+    log.log("-1", 1);
+    REQUIRE(log.log(1) == "  \"0\": 1\n");
+    REQUIRE(log.log("1", 1) == "  \"1\": 1\n");
+    REQUIRE(log.log(1) == "  \"2\": 1\n");
+  }
+
+  SECTION("explicit key after anonymous one") {
+    log.log(1);
+    REQUIRE(log.log("0", 1) == "  \"0'\": 1\n");
+    REQUIRE(log.log(1) == "  \"1\": 1\n");
+  }
+
+  SECTION("not remembered") {
+    log.set_retention(Log::RETAIN_NONE);
+    for(int i = 0; i < 100000; i++)
+      log.emit(i);
+    REQUIRE(log.remembered_keys() == 0);
+    REQUIRE(log.log("99999", 1) == "  \"99999'\": 1\n");
+    REQUIRE(log.log("100000", 1) == "  \"100000\": 1\n");
+    REQUIRE(log.remembered_keys() == 2);
+    REQUIRE(log.log(1) == "  \"100001\": 1\n");
+  }
+}
+
+TEST_CASE("Repeated keys", "[Log]")
+{
+  Log::Log log("log", false);
+
+  SECTION("many repeats") {
+    for(int i = 0; i < 100; i++)
+      log.log("x", i);
+    REQUIRE(log.log("x", 1) == "  \"x" + string(100, '\'') + "\": 1\n");
+    REQUIRE(log.remembered_keys() == 1);
+  }
+
+  SECTION("explicit primed keys") {
+    log.log("x", 1);
+    log.log("x''", 1);
+    REQUIRE(log.log("x", 1) == "  \"x'\": 1\n");
+    REQUIRE(log.log("x", 1) == "  \"x'''\": 1\n");
+    REQUIRE(log.log("x'", 1) == "  \"x''''\": 1\n");
+    REQUIRE(log.log("x", 1) == "  \"x'''''\": 1\n");
+  }
+
+  SECTION("many distinct keys") {
+    for(int i = 0; i < 1000; i++)
+      log.log("k" + via_stream(i), i);
+    REQUIRE(log.log("k999", 1) == "  \"k999'\": 1\n");
+    REQUIRE(log.log("k1000", 1) == "  \"k1000\": 1\n");
+  }
+}
+
+TEST_CASE("list", "[Log]")
+{
+  Log::Log log("log", true);
+
+  SECTION("list double [0.5, 1e-07]") {
+    list<double> l;
+    l += 0.5, 1e-7;
+    REQUIRE(log.log(l) ==
+            string("  \"0\": [0.5, 1e-07]\n"));
+  }
+
+  SECTION("list string [\"a\", \"b\"]") {
+    list<string> l;
+    l += string("a"), string("b");
+    REQUIRE(log.log(l) ==
+            string("  \"0\": [\"a\", \"b\"]\n"));
+  }
+}
+
+static size_t allocations;
+
+template<typename T>
+struct counting_allocator : public std::allocator<T>
+{
+  template<typename U> struct rebind { typedef counting_allocator<U> other; };
+  counting_allocator() {}
+  template<typename U> counting_allocator(const counting_allocator<U>&) {}
+  T* allocate(size_t n, const void* = 0)
+  {
+    allocations++;
+    return std::allocator<T>::allocate(n);
+  }
+};
+
+TEST_CASE("No copies", "[Log]")
+{
+  Log::Log log("log", false);
+
+  SECTION("containers are not copied") {
+    vector<int, counting_allocator<int> > v(1000, 7);
+    list<double, counting_allocator<double> > l(1000, 0.5);
+    allocations = 0;
+    log.log(v);
+    log.log("v", v);
+    log(v);
+    log("v", v);
+    log.log(l);
+    log("l", l);
+    REQUIRE(allocations == 0);
+  }
+
+  SECTION("string literals") {
+    REQUIRE(log.log("k", "v") == "  \"k\": \"v\"\n");
+    REQUIRE(log("w") == "  \"0\": \"w\"\n");
+    const char* p = "p\n";
+    REQUIRE(log(p) == "  \"1\": \"p\\n\"\n");
+  }
+}
+
+TEST_CASE("emit", "[Log]")
+{
+  ostringstream out;
+  Log::StreamSink sink(out);
+  Log::Log log("log", sink);
+
+  log.emit(1);
+  log.emit("x", 2.5);
+  log.emit("s", "a\"b");
+  vector<int> v;
+  v += 1, 2;
+  log.emit("v", v);
+  REQUIRE(out.str() ==
+          "---\n\"log\":\n  \"0\": 1\n  \"x\": 2.5\n  \"s\": \"a\\\"b\"\n  \"v\": [1, 2]\n");
+  REQUIRE(log.log(3) == "  \"1\": 3\n");
+}
+
+TEST_CASE("Retained bytes", "[Log]")
+{
+  Log::Log log("log", false);
+  REQUIRE(log.retained_bytes() == string("---\n\"log\":\n").size());
+  string big(100000, 'x');
+  log.log("big", big);
+  log.log(1);
+  REQUIRE(log.retained_bytes() == log.str().size() - 4);
+  REQUIRE(log.str().substr(log.str().size() - 13) == "  \"0\": 1\n...\n");
+
+  log.set_retention(Log::RETAIN_NONE);
+  REQUIRE(log.retained_bytes() == 0);
+}
+
+TEST_CASE("Flight recorder", "[Log]")
+{
+  Log::Log log("log", false);
+  log.set_retention(Log::RETAIN_TAIL, 64);
+
+  SECTION("everything fits") {
+    log.log(1);
+    REQUIRE(log.str() == "---\n\"log\":\n  \"0\": 1\n...\n");
+  }
+
+  SECTION("enclosing keys come back") {
+    log.open("a");
+    log.log("x", 1);
+    log.close();
+    log.open("b");
+    log.open("c");
+    for(int i = 0; i < 10; i++)
+      log.log(i);
+    REQUIRE(log.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"b\":\n"
+            "    \"c\":\n"
+            "      \"6\": 6\n"
+            "      \"7\": 7\n"
+            "      \"8\": 8\n"
+            "      \"9\": 9\n"
+            "...\n");
+    REQUIRE(log.retained_bytes() <= 64);
+  }
+
+  SECTION("closed scopes are not re-emitted") {
+    log.open("a");
+    for(int i = 0; i < 10; i++)
+      log.log(i);
+    log.close();
+    for(int i = 0; i < 6; i++)
+      log.log("y" + via_stream(i), 1);
+    REQUIRE(log.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"y0\": 1\n"
+            "  \"y1\": 1\n"
+            "  \"y2\": 1\n"
+            "  \"y3\": 1\n"
+            "  \"y4\": 1\n"
+            "  \"y5\": 1\n"
+            "...\n");
+  }
+
+  SECTION("nothing logged yet") {
+    REQUIRE(log.str() == "---\n\"log\":\n...\n");
+  }
+
+  SECTION("line longer than the ring") {
+    log.log("big", string(100, 'x'));
+    log.log(1);
+    REQUIRE(log.str() == "---\n\"log\":\n  \"0\": 1\n...\n");
+  }
+}
+
+TEST_CASE("Blocks", "[Log]")
+{
+  Log::Log log("log", false);
+
+  SECTION("splice") {
+    Log::Log block = log.block();
+    block.log("x", 1);
+    block.open("sub");
+    block.log(2);
+    block.close();
+    block.close();
+    log.log("x", 0);
+    log.splice("x", block);
+    log.log("y", 3);
+    REQUIRE(log.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"x\": 0\n"
+            "  \"x'\":\n"
+            "    \"x\": 1\n"
+            "    \"sub\":\n"
+            "      \"0\": 2\n"
+            "  \"y\": 3\n"
+            "...\n");
+  }
+
+  SECTION("block is reusable") {
+    Log::Log block = log.block();
+    block.log("x", 1);
+    log.splice("a", block);
+    block.log("x", 2);
+    log.splice("a", block);
+    REQUIRE(log.str() ==
+            "---\n\"log\":\n  \"a\":\n    \"x\": 1\n  \"a'\":\n    \"x\": 2\n...\n");
+  }
+
+  SECTION("reindented to where it lands") {
+    Log::Log block = log.block();
+    block.open("s");
+    block.log(1);
+    log.open("deeper");
+    log.splice("b", block);
+    REQUIRE(log.str() ==
+            "---\n\"log\":\n  \"deeper\":\n    \"b\":\n      \"s\":\n        \"0\": 1\n...\n");
+  }
+}
+
+TEST_CASE("Stats", "[Log]")
+{
+  Log::Log log("log", false);
+
+  SECTION("accumulates") {
+    Log::Stats s;
+    s.add(2);
+    s.add(4);
+    s.add(4);
+    s.add(4);
+    s.add(5);
+    s.add(5);
+    s.add(7);
+    s.add(9);
+    s.add(NAN);
+    REQUIRE(s.count() == 8);
+    REQUIRE(s.min() == 2);
+    REQUIRE(s.max() == 9);
+    REQUIRE(s.mean() == 5);
+    REQUIRE(s.variance() == Approx(32.0 / 7));
+  }
+
+  SECTION("log-linear buckets") {
+    REQUIRE(Log::Stats::bucket(1) == 1);
+    REQUIRE(Log::Stats::bucket(1.2) == 1);
+    REQUIRE(Log::Stats::bucket(1.3) == 1.25);
+    REQUIRE(Log::Stats::bucket(7) == 7);
+    REQUIRE(Log::Stats::bucket(1000) == 896);
+    REQUIRE(Log::Stats::bucket(-0.3) == -0.25);
+    REQUIRE(Log::Stats::bucket(0) == 0);
+  }
+
+  SECTION("logged as a map") {
+    Log::Stats s;
+    s.add(1);
+    s.add(3);
+    log.log("t", s);
+    log.log("empty", Log::Stats());
+    REQUIRE(log.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"t\":\n"
+            "    \"count\": 2\n"
+            "    \"min\": 1\n"
+            "    \"max\": 3\n"
+            "    \"mean\": 2\n"
+            "    \"variance\": 2\n"
+            "    \"histogram\":\n"
+            "      \"1\": 1\n"
+            "      \"3\": 1\n"
+            "  \"empty\":\n"
+            "    \"count\": 0\n"
+            "...\n");
+  }
+
+  SECTION("written when the scope closes") {
+    log.open("run");
+    Log::Stats& latency = log.aggregate("latency");
+    for(int i = 0; i < 1000; i++) {
+      latency.add(0.5);
+      log.emit("", i);
+    }
+    log.log("last", 1);
+    log.close();
+    log.log("after", 2);
+    string out = log.str();
+    REQUIRE(out.find("    \"last\": 1\n"
+                     "    \"latency\":\n"
+                     "      \"count\": 1000\n"
+                     "      \"min\": 0.5\n") != string::npos);
+    REQUIRE(out.find("      \"histogram\":\n"
+                     "        \"0.5\": 1000\n"
+                     "  \"after\": 2\n") != string::npos);
+  }
+
+  SECTION("the key is taken at once") {
+    log.aggregate("x");
+    log.log("x", 1);
+    log.terminator();
+    REQUIRE(log.str().find("  \"x'\": 1\n  \"x\":\n    \"count\": 0\n") != string::npos);
+  }
+
+  SECTION("aggregated in a block") {
+    Log::Log block = log.block();
+    block.aggregate("lat").add(1);
+    log.splice("w", block);
+    REQUIRE(log.str().find("  \"w\":\n"
+                           "    \"lat\":\n"
+                           "      \"count\": 1\n") != string::npos);
+  }
+}
+
+// Remembers each write() separately
+struct WritesSink : public Log::Sink
+{
+  vector<string> writes;
+  void write(const char* data, size_t n) { writes.push_back(string(data, n)); }
+};
+
+TEST_CASE("Chunked containers", "[Log]")
+{
+  Log::Log log("log", false);
+  log.set_chunk_size(3);
+  vector<int> v;
+  for(int i = 0; i < 7; i++)
+    v.push_back(i);
+
+  SECTION("spread over lines") {
+    log.open("a");
+    log.log("v", v);
+    log.log("short", vector<int>(3, 1));
+    log.close();
+    log.log(list<string>(4, "s"));
+    REQUIRE(log.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"a\":\n"
+            "    \"v\": [0, 1, 2,\n"
+            "      3, 4, 5,\n"
+            "      6]\n"
+            "    \"short\": [1, 1, 1]\n"
+            "  \"0\": [\"s\", \"s\", \"s\",\n"
+            "    \"s\"]\n"
+            "...\n");
+  }
+
+  SECTION("each line reaches the sink on its own") {
+    WritesSink sink;
+    Log::Log streamed("log", sink);
+    streamed.set_chunk_size(3);
+    REQUIRE(streamed.log("v", v) == "");
+    REQUIRE(sink.writes.size() == 5);
+    REQUIRE(sink.writes[2] == "  \"v\": [0, 1, 2,\n");
+    REQUIRE(sink.writes[4] == "    6]\n");
+  }
+
+  SECTION("flight recorder drops a sequence whole") {
+    log.set_retention(Log::RETAIN_TAIL, 40);
+    log.log("v", v);
+    log.log("x", 1);
+    log.log("y", 2);
+    REQUIRE(log.str() == "---\n\"log\":\n  \"x\": 1\n  \"y\": 2\n...\n");
+    log.log("w", v);
+    REQUIRE(log.str() == "---\n\"log\":\n"
+            "  \"w\": [0, 1, 2,\n    3, 4, 5,\n    6]\n...\n");
+  }
+
+  SECTION("flight recorder too small for the sequence") {
+    log.set_retention(Log::RETAIN_TAIL, 20);
+    log.log("v", v);
+    REQUIRE(log.str() == "---\n\"log\":\n...\n");
+    log.log("x", 1);
+    REQUIRE(log.str() == "---\n\"log\":\n  \"x\": 1\n...\n");
+  }
+
+  SECTION("files rotate between entries") {
+    string path("test-Log-YAML.chunked.yaml"), first = path + ".1";
+    remove(path.c_str());
+    remove(first.c_str());
+    {
+      Log::RotatingSink sink(path, 20);
+      Log::Log rotated("log", sink);
+      rotated.set_chunk_size(3);
+      rotated.log("v", v);
+      rotated.log("x", 1);
+    }
+    REQUIRE(slurp(first) ==
+            "---\n\"log\":\n  \"v\": [0, 1, 2,\n    3, 4, 5,\n    6]\n...\n");
+    REQUIRE(slurp(path) == "---\n\"log\":\n  \"x\": 1\n");
+    remove(path.c_str());
+    remove(first.c_str());
+  }
+}
+
+static int evaluated = 0;
+
+static int counted(int v)
+{
+  evaluated++;
+  return v;
+}
+
+TEST_CASE("Severity", "[Log]")
+{
+  Log::Log log("log", false);
+  evaluated = 0;
+
+  SECTION("runtime threshold") {
+    log.set_threshold(Log::SEVERITY_INFO);
+    LOG_YAML_DEBUG(log, "d", counted(1));
+    LOG_YAML_INFO(log, "i", counted(2));
+    LOG_YAML_ERROR(log, "e", counted(3));
+    REQUIRE(evaluated == 2);
+    REQUIRE(log.str() == "---\n\"log\":\n  \"i\": 2\n  \"e\": 3\n...\n");
+  }
+
+  SECTION("below the compile-time minimum") {
+    LOG_YAML_TRACE(log, "t", counted(1));
+    LOG_YAML_DEBUG(log, "d", counted(2));
+    REQUIRE(evaluated == 1);
+    REQUIRE(log.str() == "---\n\"log\":\n  \"d\": 2\n...\n");
+  }
+
+  SECTION("log evaluated once") {
+    Log::Log* logs[] = { &log, &log };
+    Log::Log** next = logs;
+    LOG_YAML_INFO(**next++, "i", 1);
+    REQUIRE(next == logs + 1);
+    REQUIRE(log.str() == "---\n\"log\":\n  \"i\": 1\n...\n");
+  }
+
+  SECTION("off") {
+    log.set_threshold(Log::SEVERITY_OFF);
+    LOG_YAML_ERROR(log, "e", counted(1));
+    REQUIRE(evaluated == 0);
+    REQUIRE(log.enabled(Log::SEVERITY_ERROR) == false);
+  }
+
+  SECTION("blocks keep the threshold") {
+    log.set_threshold(Log::SEVERITY_WARN);
+    Log::Log block = log.block();
+    REQUIRE(block.enabled(Log::SEVERITY_INFO) == false);
+    REQUIRE(block.enabled(Log::SEVERITY_WARN));
+  }
+}
+
+TEST_CASE("Sampling", "[Log]")
+{
+  Log::Log log("log", false);
+  evaluated = 0;
+
+  SECTION("every n") {
+    Log::Sampler site("every", Log::SAMPLE_EVERY_N, 3);
+    string taken;
+    for(int i = 0; i < 10; i++)
+      taken += site.sample() ? '1' : '0';
+    REQUIRE(taken == "1001001001");
+    REQUIRE(site.suppressed() == 6);
+  }
+
+  SECTION("first k then back off") {
+    Log::Sampler site("backoff", Log::SAMPLE_BACKOFF, 2);
+    vector<int> taken;
+    for(int i = 1; i <= 40; i++)
+      if(site.sample())
+        taken.push_back(i);
+    REQUIRE(taken == vector<int>(list_of(1)(2)(4)(8)(16)(32)));
+    REQUIRE(site.suppressed() == 34);
+  }
+
+  SECTION("token bucket") {
+    Log::Sampler site("rate", Log::SAMPLE_RATE, 1e-3, 5);
+    int taken = 0;
+    for(int i = 0; i < 100; i++)
+      taken += site.sample();
+    REQUIRE(taken == 5);
+    REQUIRE(site.suppressed() == 95);
+  }
+
+  SECTION("held back calls are not evaluated") {
+    for(int i = 0; i < 10; i++)
+      LOG_YAML_SAMPLE(log, Log::SAMPLE_EVERY_N, 5, "", counted(i));
+    REQUIRE(evaluated == 2);
+    REQUIRE(log.str() == "---\n\"log\":\n  \"0\": 0\n  \"1\": 5\n...\n");
+  }
+
+  SECTION("report") {
+    // starts the count over for sites left from other tests
+    Log::Log scratch("scratch", false);
+    Log::report_suppressed(scratch);
+
+    Log::Sampler a("a.cpp:1", Log::SAMPLE_EVERY_N, 2);
+    Log::Sampler b("b.cpp:2", Log::SAMPLE_EVERY_N, 2);
+    Log::Sampler c("c.cpp:3", Log::SAMPLE_EVERY_N, 2);
+    for(int i = 0; i < 4; i++)
+      a.sample();
+    c.sample();
+    c.sample();
+    Log::report_suppressed(log);
+    Log::report_suppressed(log);
+    REQUIRE(log.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"suppressed\":\n"
+            "    \"a.cpp:1\": 2\n"
+            "    \"c.cpp:3\": 1\n"
+            "...\n");
+  }
+}
+
+#ifdef LOG_YAML_THREADS
+static std::atomic<int> sampled_in(0);
+
+static void sample_from(Log::Sampler* every, Log::Sampler* backoff)
+{
+  Log::Log log("log", false);
+  for(int i = 0; i < 10000; i++) {
+    LOG_YAML_SAMPLE(log, Log::SAMPLE_EVERY_N, 100, "i", sampled_in++);
+    every->sample();
+    backoff->sample();
+  }
+}
+
+TEST_CASE("Sampling from many threads", "[Log]")
+{
+  Log::Log scratch("scratch", false);
+  Log::report_suppressed(scratch);
+
+  Log::Sampler every("every", Log::SAMPLE_EVERY_N, 7);
+  Log::Sampler backoff("backoff", Log::SAMPLE_BACKOFF, 10);
+  vector<std::thread> threads;
+  for(int t = 0; t < 4; t++)
+    threads.push_back(std::thread(sample_from, &every, &backoff));
+  for(size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+
+  // 40000 events between them, counted as if from one thread
+  REQUIRE(sampled_in == 400);
+  REQUIRE(every.suppressed() == 40000 - 5715);
+  REQUIRE(backoff.suppressed() == 40000 - 10 - 11);
+}
+
+static void worker(Log::SharedLog* shared, int id)
+{
+  for(int i = 0; i < 50; i++) {
+    Log::Log block = shared->block();
+    block.log("id", id);
+    block.open("values");
+    for(int j = 0; j < 5; j++)
+      block.log(j);
+    block.close();
+    shared->commit("worker", block);
+  }
+}
+
+TEST_CASE("SharedLog", "[Log]")
+{
+  Log::Log log("log", false);
+  Log::SharedLog shared(log);
+  vector<std::thread> threads;
+  for(int t = 0; t < 4; t++)
+    threads.push_back(std::thread(worker, &shared, t));
+  for(size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+
+  // Every block arrives whole
+  istringstream in(log.str());
+  string line;
+  int blocks = 0;
+  getline(in, line);
+  getline(in, line);
+  while(getline(in, line) && line != "...") {
+    REQUIRE(line.substr(0, 9) == "  \"worker");
+    getline(in, line);
+    REQUIRE(line.substr(0, 10) == "    \"id\": ");
+    getline(in, line);
+    REQUIRE(line == "    \"values\":");
+    for(int j = 0; j < 5; j++) {
+      getline(in, line);
+      REQUIRE(line == "      \"" + via_stream(j) + "\": " + via_stream(j));
+    }
+    blocks++;
+  }
+  REQUIRE(blocks == 200);
+}
+#endif
+
+TEST_CASE("Child logs", "[Log]")
+{
+  Log::Log log("log", false);
+
+  SECTION("merged in spawn order") {
+    Log::Log& a = log.spawn("job");
+    Log::Log& b = log.spawn("job");
+    b.log("n", 2);
+    a.log("n", 1);
+    log.log("after", 3);
+    log.join();
+    REQUIRE(log.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"after\": 3\n"
+            "  \"job\":\n"
+            "    \"n\": 1\n"
+            "  \"job'\":\n"
+            "    \"n\": 2\n"
+            "...\n");
+  }
+
+  SECTION("merged when the scope closes") {
+    log.open("s");
+    log.spawn("c").log(1);
+    log.log("x", 0);
+    log.close();
+    log.log("y", 2);
+    REQUIRE(log.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"s\":\n"
+            "    \"x\": 0\n"
+            "    \"c\":\n"
+            "      \"0\": 1\n"
+            "  \"y\": 2\n"
+            "...\n");
+  }
+
+  SECTION("children of children") {
+    Log::Log& c = log.spawn("c");
+    c.open("o");
+    c.spawn("g").log("z", 1);
+    REQUIRE(log.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"c\":\n"
+            "    \"o\":\n"
+            "      \"g\":\n"
+            "        \"z\": 1\n"
+            "...\n");
+  }
+
+  SECTION("streamed by terminator") {
+    ostringstream out;
+    Log::StreamSink sink(out);
+    Log::Log streamed("log", sink);
+    streamed.open("s");
+    streamed.spawn("c").log("v", 1);
+    streamed.log("w", 2);
+    streamed.terminator();
+    REQUIRE(out.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"s\":\n"
+            "    \"w\": 2\n"
+            "    \"c\":\n"
+            "      \"v\": 1\n"
+            "...\n");
+  }
+
+  SECTION("deeper children first") {
+    ostringstream out;
+    Log::StreamSink sink(out);
+    Log::Log streamed("log", sink);
+    streamed.spawn("A").log("x", 1);
+    streamed.aggregate("n").add(1);
+    streamed.open("s");
+    streamed.spawn("B").log("y", 2);
+    streamed.aggregate("m").add(2);
+    streamed.terminator();
+    REQUIRE(out.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"s\":\n"
+            "    \"B\":\n"
+            "      \"y\": 2\n"
+            "    \"m\":\n"
+            "      \"count\": 1\n"
+            "      \"min\": 2\n"
+            "      \"max\": 2\n"
+            "      \"mean\": 2\n"
+            "      \"variance\": 0\n"
+            "      \"histogram\":\n"
+            "        \"2\": 1\n"
+            "  \"A\":\n"
+            "    \"x\": 1\n"
+            "  \"n\":\n"
+            "    \"count\": 1\n"
+            "    \"min\": 1\n"
+            "    \"max\": 1\n"
+            "    \"mean\": 1\n"
+            "    \"variance\": 0\n"
+            "    \"histogram\":\n"
+            "      \"1\": 1\n"
+            "...\n");
+  }
+
+  SECTION("spawned in a block") {
+    Log::Log block = log.block();
+    block.spawn("c").log("v", 1);
+    block.log("w", 2);
+    log.splice("b", block);
+    REQUIRE(log.str() ==
+            "---\n"
+            "\"log\":\n"
+            "  \"b\":\n"
+            "    \"w\": 2\n"
+            "    \"c\":\n"
+            "      \"v\": 1\n"
+            "...\n");
+  }
+}
+
+#ifdef LOG_YAML_THREADS
+static void fill_child(Log::Log* child, int id)
+{
+  for(int i = 0; i < 100; i++)
+    child->log("v", id * 1000 + i);
+}
+
+TEST_CASE("Child logs across threads", "[Log]")
+{
+  Log::Log threaded("log", false);
+  Log::Log serial("log", false);
+  vector<std::thread> threads;
+  for(int t = 0; t < 4; t++) {
+    threads.push_back(std::thread(fill_child, &threaded.spawn("worker"), t));
+    fill_child(&serial.spawn("worker"), t);
+  }
+  for(size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+  REQUIRE(threaded.str() == serial.str());
+}
+#endif
+
+#ifdef LOG_YAML_THREADS
+TEST_CASE("Parallel formatting", "[Log]")
+{
+  vector<double> d;
+  vector<int> i;
+  srand(7);
+  for(int n = 0; n < 20000; n++) {
+    d.push_back((rand() - RAND_MAX / 2) * 1e-3 / (n + 1));
+    i.push_back(rand() - RAND_MAX / 2);
+  }
+  Log::Log serial("log", false);
+  serial.log("d", d);
+  serial.log("i", i);
+  serial.log("few", vector<int>(3, 7));
+  serial.log("none", vector<int>());
+
+  const unsigned threads[] = { 2, 3, 8 };
+  for(size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+    Log::Log parallel("log", false);
+    parallel.set_format_threads(threads[t], 0);
+    parallel.log("d", d);
+    parallel.log("i", i);
+    parallel.log("few", vector<int>(3, 7));
+    parallel.log("none", vector<int>());
+    REQUIRE(parallel.str() == serial.str());
+  }
+}
+#endif
@@ -0,0 +1,32 @@
+// Renders a Log::Recorder binary stream as Log-YAML
+//
+//   c++ -O2 log-yaml-render.cpp -o log-yaml-render
+//   ./log-yaml-render run.lyb > run.yaml
+//   ./log-yaml-render < run.lyb > run.yaml
+
+#include "../Log-YAML.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+  ostringstream records;
+  if(argc > 1) {
+    ifstream f(argv[1], ios::binary);
+    if(!f) {
+      cerr << argv[0] << ": can't open " << argv[1] << endl;
+      return 1;
+    }
+    records << f.rdbuf();
+  }
+  else
+    records << cin.rdbuf();
+
+  Log::StreamSink out(cout);
+  Log::render(records.str(), out);
+  return 0;
+}